@@ -0,0 +1,169 @@
+// Checks KdTree (parallel build) against nanoflann's own serial build on the
+// same points: the point order and every node of both trees must be the same,
+// and so must the results of kNN and (unsorted) radius searches. Builds the
+// parallel tree with 1 thread and with --threads threads, and times each
+// build against the serial one (best of --repeat). Exits with a non-zero
+// status on a difference.
+//
+// Without an input point cloud, random clusters of points are used, with
+// duplicated points (ties in both the splits and the searches).
+
+#include <chrono>
+#include <random>
+#include <omp.h>
+
+#include "../constants.hpp"
+#include "../point_io.hpp"
+
+#include "../vendor/cxxopts.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, PointSet>, PointSet, 3, size_t> SerialKdTree;
+
+static PointSet *randomPointSet(const size_t count, std::mt19937 &gen) {
+    std::uniform_real_distribution<float> center(0.0f, 500.0f);
+    std::normal_distribution<float> offset(0.0f, 2.0f);
+    std::uniform_int_distribution<int> kind(0, 19);
+
+    auto *r = new PointSet();
+    r->points.resize(count);
+    std::array<float, 3> c = { 0.0f, 0.0f, 0.0f };
+    for (size_t i = 0; i < count; i++) {
+        if (i % 1000 == 0) c = { center(gen), center(gen), center(gen) / 10.0f };
+        if (i > 0 && kind(gen) == 0) r->points[i] = r->points[i - 1];
+        else r->points[i] = { c[0] + offset(gen), c[1] + offset(gen), c[2] + offset(gen) };
+    }
+    return r;
+}
+
+// Number of nodes that differ between the two trees
+template <typename N>
+static size_t compareNodes(const N *a, const N *b) {
+    if ((a->child1 == nullptr) != (b->child1 == nullptr)) return 1;
+    if (a->child1 == nullptr) {
+        return a->node_type.lr.left != b->node_type.lr.left || a->node_type.lr.right != b->node_type.lr.right ? 1 : 0;
+    }
+
+    const size_t diff = a->node_type.sub.divfeat != b->node_type.sub.divfeat ||
+        a->node_type.sub.divlow != b->node_type.sub.divlow ||
+        a->node_type.sub.divhigh != b->node_type.sub.divhigh ? 1 : 0;
+    return diff + compareNodes(a->child1, b->child1) + compareNodes(a->child2, b->child2);
+}
+
+// Number of queries whose results differ between the two trees
+static size_t compareSearches(const KdTree &tree, const SerialKdTree &serial, const PointSet &pSet, const size_t numQueries, const int k, const float radius) {
+    const size_t step = std::max<size_t>(1, pSet.count() / std::max<size_t>(1, numQueries));
+    std::vector<size_t> ids(k), serialIds(k);
+    std::vector<float> dists(k), serialDists(k);
+    std::vector<nanoflann::ResultItem<size_t, float> > matches, serialMatches;
+    const nanoflann::SearchParameters unsorted(0, false);
+    size_t diff = 0;
+
+    for (size_t i = 0; i < pSet.count(); i += step) {
+        const float *q = pSet.points[i].data();
+        const size_t n = tree.knnSearch(q, k, ids.data(), dists.data());
+        const size_t serialN = serial.knnSearch(q, k, serialIds.data(), serialDists.data());
+        bool same = n == serialN && std::equal(ids.begin(), ids.begin() + n, serialIds.begin()) &&
+            std::equal(dists.begin(), dists.begin() + n, serialDists.begin());
+
+        tree.radiusSearch(q, radius * radius, matches, unsorted);
+        serial.radiusSearch(q, radius * radius, serialMatches, unsorted);
+        same = same && matches.size() == serialMatches.size();
+        for (size_t j = 0; same && j < matches.size(); j++) {
+            same = matches[j].first == serialMatches[j].first && matches[j].second == serialMatches[j].second;
+        }
+
+        if (!same) diff++;
+    }
+    return diff;
+}
+
+int main(int argc, char **argv) {
+    cxxopts::Options options("kdtree_check", "Checks the parallel KdTree build against nanoflann's serial build");
+    options.add_options()
+        ("i,input", "Input point cloud (random points if not set)", cxxopts::value<std::string>())
+        ("n,points", "Number of random points", cxxopts::value<size_t>()->default_value("2000000"))
+        ("t,threads", "Threads of the parallel build", cxxopts::value<int>()->default_value(std::to_string(omp_get_max_threads())))
+        ("q,queries", "Number of queries compared", cxxopts::value<size_t>()->default_value("100000"))
+        ("radius", "Radius of the compared radius searches", cxxopts::value<float>()->default_value(MKSTR(RADIUS)))
+        ("repeat", "Builds timed of each tree", cxxopts::value<int>()->default_value("3"))
+        ("seed", "Random seed", cxxopts::value<unsigned int>()->default_value("7"))
+        ("h,help", "Print usage")
+        ;
+    options.parse_positional({ "input" });
+    options.positional_help("[input point cloud]");
+
+    try {
+        const auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        const int threads = result["threads"].as<int>();
+        const size_t numQueries = result["queries"].as<size_t>();
+        const float radius = result["radius"].as<float>();
+        const int repeat = result["repeat"].as<int>();
+        if (threads < 1 || repeat < 1) throw std::invalid_argument("Invalid number of threads or builds");
+
+        std::mt19937 gen(result["seed"].as<unsigned int>());
+        auto *pSet = result.count("input") ?
+            readPointSet(result["input"].as<std::string>()) :
+            randomPointSet(result["points"].as<size_t>(), gen);
+
+        // Reference: nanoflann's serial build, as used before KdTree
+        double serialTime = std::numeric_limits<double>::max();
+        std::unique_ptr<SerialKdTree> serial;
+        for (int r = 0; r < repeat; r++) {
+            serial.reset();
+            const auto start = Clock::now();
+            serial.reset(new SerialKdTree(3, *pSet, { KDTREE_MAX_LEAF }));
+            serialTime = std::min(serialTime, elapsed(start));
+        }
+
+        std::cout << "Points: " << pSet->count() << ", cores: " << omp_get_num_procs() << std::endl;
+        std::cout << "threads\tserial build ms\tparallel build ms\tdifferent points\tdifferent nodes\tdifferent queries" << std::endl;
+
+        size_t differences = 0;
+        for (const int t : { 1, threads }) {
+            omp_set_num_threads(t);
+
+            double time = std::numeric_limits<double>::max();
+            std::unique_ptr<KdTree> tree;
+            for (int r = 0; r < repeat; r++) {
+                tree.reset();
+                const auto start = Clock::now();
+                tree.reset(new KdTree(3, *pSet, { KDTREE_MAX_LEAF }));
+                time = std::min(time, elapsed(start));
+            }
+
+            size_t points = 0;
+            for (size_t i = 0; i < pSet->count(); i++) {
+                if (tree->vAcc_[i] != serial->vAcc_[i]) points++;
+            }
+            const size_t nodes = pSet->count() == 0 ? 0 : compareNodes(tree->root_node_, serial->root_node_);
+            const size_t queries = compareSearches(*tree, *serial, *pSet, numQueries, K_NEIGHBORS, radius);
+
+            std::cout << t << "\t" << serialTime << "\t" << time << "\t" << points << "\t" << nodes << "\t" << queries << std::endl;
+            differences += points + nodes + queries;
+            if (t == threads) break;
+        }
+
+        serial.reset();
+        RELEASE_POINTSET(pSet);
+
+        std::cout << (differences == 0 ? "OK" : "FAILED") << ": " << differences << " differences" << std::endl;
+        if (differences > 0) return EXIT_FAILURE;
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
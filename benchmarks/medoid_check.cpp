@@ -0,0 +1,165 @@
+// Checks Scale::computeMedoid (the neighbor closest to the centroid) against
+// the O(k^2) loop it replaced (the neighbor with the smallest sum of squared
+// distances to all others) on random neighborhoods: large coordinate offsets,
+// as in projected coordinate systems, and neighborhoods with ties (duplicate
+// points, points symmetric around the centroid, lattices). Exits with a
+// non-zero status if any medoid differs.
+
+#include <random>
+
+#include "../constants.hpp"
+#include "../point_io.hpp"
+#include "../scale.hpp"
+
+#include "../vendor/cxxopts.hpp"
+
+// Scale::computeMedoid before it took a single pass, verbatim (sums of
+// squared distances rounded to float at every step)
+static Eigen::Vector3f quadraticMedoid(const PointSet *scaledSet, const std::vector<size_t> &neighborIds) {
+    float mx, my, mz;
+    mx = my = mz = 0.0;
+    float minDist = std::numeric_limits<float>::max();
+    for (size_t const &i : neighborIds) {
+        float sum = 0.0;
+        const float xi = scaledSet->points[i][0];
+        const float yi = scaledSet->points[i][1];
+        const float zi = scaledSet->points[i][2];
+
+        for (size_t const &j : neighborIds) {
+            sum += std::pow<double>(xi - scaledSet->points[j][0], 2) +
+                std::pow<double>(yi - scaledSet->points[j][1], 2) +
+                std::pow<double>(zi - scaledSet->points[j][2], 2);
+        }
+
+        if (sum < minDist) {
+            mx = xi;
+            my = yi;
+            mz = zi;
+            minDist = sum;
+        }
+    }
+
+    Eigen::Vector3f medoid;
+    medoid << mx, my, mz;
+
+    return medoid;
+}
+
+enum Layout { Uniform, Duplicates, Symmetric, Lattice };
+
+static const char *layoutName(const Layout layout) {
+    switch (layout) {
+        case Uniform: return "uniform";
+        case Duplicates: return "duplicates";
+        case Symmetric: return "symmetric";
+        case Lattice: return "lattice";
+    }
+    return "";
+}
+
+// Replace the points of pSet with k points around (offset, offset, 0)
+// spread over extent
+static void generate(PointSet &pSet, const size_t k, const Layout layout, const double offset, const double extent, std::mt19937 &gen) {
+    std::uniform_real_distribution<double> uniform(-extent, extent);
+    pSet.points.resize(k);
+
+    auto set = [&](const size_t i, const double x, const double y, const double z) {
+        pSet.points[i] = { static_cast<float>(offset + x), static_cast<float>(offset + y), static_cast<float>(z) };
+    };
+
+    switch (layout) {
+        case Uniform:
+            for (size_t i = 0; i < k; i++) set(i, uniform(gen), uniform(gen), uniform(gen) * 0.1);
+            break;
+        case Duplicates: {
+            // Copies of 1 to 3 distinct points
+            std::uniform_int_distribution<size_t> distinct(1, 3);
+            std::vector<std::array<double, 3> > pool(distinct(gen));
+            for (auto &p : pool) p = { uniform(gen), uniform(gen), uniform(gen) * 0.1 };
+            std::uniform_int_distribution<size_t> pick(0, pool.size() - 1);
+            for (size_t i = 0; i < k; i++) {
+                const auto &p = pool[pick(gen)];
+                set(i, p[0], p[1], p[2]);
+            }
+            break;
+        }
+        case Symmetric: {
+            // Pairs of points mirrored through the center, which every point of
+            // a pair is as close to (the center itself is added if k is odd)
+            std::vector<std::array<double, 3> > points;
+            if (k % 2 == 1) points.push_back({ 0.0, 0.0, 0.0 });
+            while (points.size() < k) {
+                const std::array<double, 3> p = { uniform(gen), uniform(gen), uniform(gen) * 0.1 };
+                points.push_back(p);
+                points.push_back({ -p[0], -p[1], -p[2] });
+            }
+            std::shuffle(points.begin(), points.end(), gen);
+            for (size_t i = 0; i < k; i++) set(i, points[i][0], points[i][1], points[i][2]);
+            break;
+        }
+        case Lattice: {
+            // Points of a 3x3x2 lattice
+            std::uniform_int_distribution<int> step(-1, 1);
+            const double spacing = extent / 2;
+            for (size_t i = 0; i < k; i++) set(i, step(gen) * spacing, step(gen) * spacing, (step(gen) > 0) * spacing * 0.1);
+            break;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    cxxopts::Options options("medoid_check", "Checks Scale::computeMedoid against the O(k^2) medoid");
+    options.add_options()
+        ("n,trials", "Neighborhoods per layout, offset and extent", cxxopts::value<size_t>()->default_value("20000"))
+        ("k,neighbors", "Points per neighborhood", cxxopts::value<size_t>()->default_value(MKSTR(K_NEIGHBORS)))
+        ("seed", "Random seed", cxxopts::value<unsigned int>()->default_value("7"))
+        ("h,help", "Print usage")
+        ;
+
+    try {
+        const auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        const size_t trials = result["trials"].as<size_t>();
+        const size_t k = result["neighbors"].as<size_t>();
+        if (k < 2) throw std::invalid_argument("Neighborhoods need at least 2 points");
+
+        std::mt19937 gen(result["seed"].as<unsigned int>());
+        PointSet pSet;
+        Scale scale(1, &pSet, 1.0, static_cast<int>(k));
+        PointSet &neighbors = *scale.scaledSet;
+        std::vector<uint32_t> neighborIds(k);
+        std::vector<size_t> quadraticIds(k);
+        for (size_t i = 0; i < k; i++) neighborIds[i] = quadraticIds[i] = i;
+        size_t mismatches = 0;
+
+        std::cout << "layout\toffset\textent\tmismatches" << std::endl;
+
+        for (const Layout layout : { Uniform, Duplicates, Symmetric, Lattice }) {
+            for (const double offset : { 0.0, 1e3, 5e5, 4e6 }) {
+                for (const double extent : { 0.01, 1.0, 50.0 }) {
+                    size_t count = 0;
+                    for (size_t t = 0; t < trials; t++) {
+                        generate(neighbors, k, layout, offset, extent, gen);
+                        if (scale.computeMedoid(neighborIds.data(), k) != quadraticMedoid(&neighbors, quadraticIds)) count++;
+                    }
+
+                    std::cout << layoutName(layout) << "\t" << offset << "\t" << extent << "\t" << count << std::endl;
+                    mismatches += count;
+                }
+            }
+        }
+
+        std::cout << (mismatches == 0 ? "OK" : "FAILED") << ": " << mismatches << " mismatches" << std::endl;
+        if (mismatches > 0) return EXIT_FAILURE;
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Compares the row by row (default) and Z-order (--morton-order) point order
+// of the scales: kNN searches of the base points and Scale::build times, with
+// hardware cache misses (perf counters) when the kernel allows reading them.
+// Also replays the neighbor reads of feature computation through a simulated
+// LRU cache, whose misses are the same on every machine but are only a model:
+// they ignore prefetching, other cache levels and the rest of the memory
+// traffic, so the hardware counts and the times are what to compare.
+
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <omp.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "../constants.hpp"
+#include "../point_io.hpp"
+#include "../scale.hpp"
+
+#include "../vendor/cxxopts.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Hardware cache misses of this process (and of threads it creates after
+// construction), or -1 where they cannot be read
+class CacheMissCounter {
+    int fd = -1;
+public:
+    CacheMissCounter() {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    ~CacheMissCounter() {
+#ifdef __linux__
+        if (fd != -1) close(fd);
+#endif
+    }
+
+    long long read() const {
+        long long value = -1;
+#ifdef __linux__
+        if (fd == -1 || ::read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+#endif
+        return value;
+    }
+};
+
+// Set associative cache with LRU replacement
+class SimulatedCache {
+    size_t numSets;
+    size_t ways;
+    std::vector<uint64_t> tags; // ways per set, most recently used first
+public:
+    size_t misses = 0;
+
+    SimulatedCache(size_t bytes, size_t ways) : numSets(bytes / 64 / ways), ways(ways), tags(numSets * ways, ~static_cast<uint64_t>(0)) {}
+
+    void access(const void *address) {
+        const uint64_t line = reinterpret_cast<uintptr_t>(address) / 64;
+        uint64_t *set = tags.data() + (line % numSets) * ways;
+
+        size_t w = 0;
+        while (w < ways && set[w] != line) w++;
+        if (w == ways) {
+            misses++;
+            w = ways - 1;
+        }
+        for (; w > 0; w--) set[w] = set[w - 1];
+        set[0] = line;
+    }
+};
+
+static std::string formatCount(const long long count) {
+    return count < 0 ? "n/a" : std::to_string(count);
+}
+
+int main(int argc, char **argv) {
+    cxxopts::Options options("morton_benchmark", "Benchmarks the row by row and Z-order point order of the scales");
+    options.add_options()
+        ("i,input", "Input point cloud", cxxopts::value<std::string>())
+        ("r,resolution", "Resolution of the first scale (-1 = estimate automatically)", cxxopts::value<double>()->default_value("-1"))
+        ("s,scales", "Number of scales", cxxopts::value<int>()->default_value(MKSTR(NUM_SCALES)))
+        ("radius", "Radius of the first scale's neighbor search", cxxopts::value<double>()->default_value(MKSTR(RADIUS)))
+        ("cache-size", "Size of the simulated cache (KB)", cxxopts::value<size_t>()->default_value("1024"))
+        ("h,help", "Print usage")
+        ;
+    options.parse_positional({ "input" });
+    options.positional_help("[input point cloud]");
+
+    // Before any thread is created, so that OpenMP threads are counted
+    const CacheMissCounter counter;
+
+    try {
+        const auto result = options.parse(argc, argv);
+        if (result.count("help") || !result.count("input")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        const auto filename = result["input"].as<std::string>();
+        double startResolution = result["resolution"].as<double>();
+        const int numScales = result["scales"].as<int>();
+        const double radius = result["radius"].as<double>();
+        const size_t cacheSize = result["cache-size"].as<size_t>() << 10;
+
+        std::vector<std::string> report;
+
+        for (const bool morton : { false, true }) {
+            auto *pointSet = readPointSet(filename);
+            if (startResolution == -1.0) startResolution = pointSet->spacing();
+
+            auto start = Clock::now();
+            auto scales = initScales(numScales, pointSet, startResolution, radius, "", morton);
+            const double initTime = elapsed(start);
+            const PointSet &queries = *pointSet->base;
+
+            std::stringstream ss;
+            ss << (morton ? "Z-order" : "row by row") << " (init " << initTime << " ms)" << std::endl;
+            ss << "scale\tpoints\tknn ms\tknn hw misses\tbuild ms\tbuild hw misses\tsimulated LRU misses" << std::endl;
+
+            for (auto *s : scales) {
+                const KdTree *index = s->scaledSet->getIndex<KdTree>();
+
+                long long misses = counter.read();
+                start = Clock::now();
+
+                #pragma omp parallel
+                {
+                    std::vector<size_t> ids(s->kNeighbors);
+                    std::vector<float> dists(s->kNeighbors);
+
+                    #pragma omp for schedule(dynamic, 256)
+                    for (long long int i = 0; i < queries.count(); i++) {
+                        index->knnSearch(queries.points[i].data(), s->kNeighbors, ids.data(), dists.data());
+                    }
+                }
+
+                const double knnTime = elapsed(start);
+                const long long knnMisses = misses < 0 ? -1 : counter.read() - misses;
+
+                // Replay the reads of feature computation: each base point's
+                // neighbors in the scaled set, in processing order
+                s->buildGraph(s->knnGraph, KnnSearch, nullptr);
+                SimulatedCache cache(cacheSize, 8);
+                for (size_t i = 0; i < s->knnGraph.count(); i++) {
+                    const uint32_t *neighbors = s->knnGraph.neighbors(i);
+                    for (size_t n = 0; n < s->knnGraph.size(i); n++) cache.access(&s->scaledSet->points[neighbors[n]]);
+                }
+                s->knnGraph.release();
+
+                misses = counter.read();
+                start = Clock::now();
+                s->build();
+                const double buildTime = elapsed(start);
+                const long long buildMisses = misses < 0 ? -1 : counter.read() - misses;
+
+                ss << s->id << "\t" << s->scaledSet->count() << "\t" << knnTime << "\t" << formatCount(knnMisses) << "\t"
+                    << buildTime << "\t" << formatCount(buildMisses) << "\t" << cache.misses << std::endl;
+            }
+
+            report.push_back(ss.str());
+
+            // Free up memory for the next pass
+            for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+            RELEASE_POINTSET(pointSet);
+        }
+
+        std::cout << std::endl << "Threads: " << omp_get_max_threads() << ", simulated LRU cache: " << (cacheSize >> 10) << " KB, 8-way" << std::endl;
+        if (counter.read() < 0) std::cout << "Hardware cache misses: n/a (perf counters cannot be read, see perf_event_paranoid)" << std::endl;
+        for (const auto &r : report) std::cout << std::endl << r;
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
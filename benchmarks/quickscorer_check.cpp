@@ -0,0 +1,169 @@
+// Checks rf::QuickScorer against FlatForest::evaluateBatch: trains small
+// forests on random data (max depth 3 to 6, float and quantized leaves) and
+// evaluates random samples with both, including NaN features, values equal
+// to split thresholds, partial blocks and a stride wider than the features.
+// The probabilities must be bitwise identical. Also times both engines on the
+// same batches (single-threaded). Exits with a non-zero status on a mismatch.
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+#include "../randomforest.hpp"
+
+#include "../vendor/cxxopts.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Random samples of numFeatures features, stride floats apart, drawn from the
+// same range as the training data. Some values are NaN, and some are copied
+// from the split thresholds of the forest, to test both sides of equality.
+static std::vector<float> randomSamples(const size_t count, const size_t numFeatures, const size_t stride, const std::vector<float> &thresholds, std::mt19937 &gen) {
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    std::uniform_int_distribution<int> kind(0, 9);
+    std::uniform_int_distribution<size_t> pick(0, thresholds.empty() ? 0 : thresholds.size() - 1);
+
+    std::vector<float> samples(count * stride, 0.0f);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t f = 0; f < numFeatures; f++) {
+            const int k = kind(gen);
+            float v = value(gen);
+            if (k == 0) v = std::numeric_limits<float>::quiet_NaN();
+            else if (k <= 2 && !thresholds.empty()) v = thresholds[pick(gen)];
+            samples[i * stride + f] = v;
+        }
+    }
+    return samples;
+}
+
+static void collectThresholds(const rf::FlatForest &forest, const rf::FlatForest::Node &node, std::vector<float> &thresholds) {
+    if (node.feature < 0) return;
+    thresholds.push_back(node.threshold);
+    collectThresholds(forest, forest.left(node), thresholds);
+    collectThresholds(forest, forest.right(node), thresholds);
+}
+
+int main(int argc, char **argv) {
+    cxxopts::Options options("quickscorer_check", "Checks rf::QuickScorer against FlatForest");
+    options.add_options()
+        ("n,samples", "Samples evaluated per forest", cxxopts::value<size_t>()->default_value("100000"))
+        ("t,trees", "Trees per forest", cxxopts::value<int>()->default_value("100"))
+        ("f,features", "Features", cxxopts::value<size_t>()->default_value("40"))
+        ("c,classes", "Classes", cxxopts::value<int>()->default_value("6"))
+        ("b,batch", "Samples per evaluateBatch call", cxxopts::value<size_t>()->default_value("1000"))
+        ("seed", "Random seed", cxxopts::value<unsigned int>()->default_value("7"))
+        ("h,help", "Print usage")
+        ;
+
+    try {
+        const auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        const size_t numSamples = result["samples"].as<size_t>();
+        const int numTrees = result["trees"].as<int>();
+        const size_t numFeatures = result["features"].as<size_t>();
+        const int numClasses = result["classes"].as<int>();
+        const size_t batch = result["batch"].as<size_t>();
+        if (numFeatures < 2 || numClasses < 2 || numTrees < 1 || batch < 1) throw std::invalid_argument("Invalid forest size");
+        std::mt19937 gen(result["seed"].as<unsigned int>());
+
+        // Training data: the class depends on a few features, with noise
+        const size_t trainRows = 20000;
+        std::vector<float> trainFeatures(trainRows * numFeatures);
+        std::vector<int> trainLabels(trainRows);
+        std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+        std::uniform_int_distribution<int> noise(0, numClasses - 1);
+        for (size_t i = 0; i < trainRows; i++) {
+            float *row = &trainFeatures[i * numFeatures];
+            for (size_t f = 0; f < numFeatures; f++) row[f] = value(gen);
+            const int label = static_cast<int>((row[0] + row[1] * row[1] + 1.0f) * numClasses / 2.0f);
+            trainLabels[i] = i % 5 == 0 ? noise(gen) : std::max(0, std::min(numClasses - 1, label));
+        }
+        const rf::FeatureDataView featureView(trainFeatures.data(), trainRows, numFeatures);
+        const rf::LabelDataView labelView(trainLabels.data(), trainRows, 1);
+        const rf::AxisAlignedRandomSplitGenerator generator;
+
+        size_t mismatches = 0;
+        std::cout << "depth\tleaf bits\tstride\tflat (ms)\tquickscorer (ms)\tmismatches" << std::endl;
+
+        for (const int depth : { 3, 5, 6 }) {
+            rf::ForestParams params;
+            params.n_trees = numTrees;
+            params.max_depth = depth;
+            rf::RandomForest rtrees(params);
+            rtrees.train(featureView, labelView, rf::LabelDataView(), generator, 0, false, false);
+
+            for (const int leafBits : { 32, 16, 8 }) {
+                rf::FlatForest forest(rtrees);
+                if (leafBits != 32) forest.quantize(leafBits);
+                const rf::QuickScorer scorer(forest);
+
+                std::vector<float> thresholds;
+                for (size_t t = 0; t < forest.numTrees(); t++) collectThresholds(forest, forest.root(t), thresholds);
+
+                for (const size_t stride : { numFeatures, numFeatures + 3 }) {
+                    const auto samples = randomSamples(numSamples, numFeatures, stride, thresholds, gen);
+                    const size_t nc = forest.numClasses();
+                    std::vector<float> flat(numSamples * nc), quick(numSamples * nc);
+
+                    // Batches of varying size, most of them not a multiple of
+                    // RF_QUICKSCORER_BLOCK
+                    auto run = [&](auto evaluateBatch, std::vector<float> &out) {
+                        const auto start = Clock::now();
+                        for (size_t i = 0, k = 0; i < numSamples; k++) {
+                            const size_t count = std::min(numSamples - i, k % 4 == 3 ? 1 : batch + k % 7);
+                            evaluateBatch(&samples[i * stride], count, stride, &out[i * nc], nc);
+                            i += count;
+                        }
+                        return elapsed(start);
+                    };
+                    const double flatTime = run([&](const float *s, size_t n, size_t st, float *r, size_t rs) { forest.evaluateBatch(s, n, st, r, rs); }, flat);
+                    const double quickTime = run([&](const float *s, size_t n, size_t st, float *r, size_t rs) { scorer.evaluateBatch(s, n, st, r, rs); }, quick);
+
+                    size_t count = 0;
+                    for (size_t i = 0; i < numSamples; i++) {
+                        if (std::memcmp(&flat[i * nc], &quick[i * nc], nc * sizeof(float)) != 0) count++;
+                    }
+
+                    std::cout << depth << "\t" << leafBits << "\t" << stride << "\t" << flatTime << "\t" << quickTime << "\t" << count << std::endl;
+                    mismatches += count;
+                }
+            }
+        }
+
+        // Deeper trees are rejected
+        rf::ForestParams params;
+        params.n_trees = 4;
+        params.max_depth = 12;
+        rf::RandomForest deep(params);
+        deep.train(featureView, labelView, rf::LabelDataView(), generator, 0, false, false);
+        const rf::FlatForest deepForest(deep);
+        bool rejected = false;
+        try {
+            const rf::QuickScorer scorer(deepForest);
+        }
+        catch (const std::runtime_error &) {
+            rejected = true;
+        }
+        if (rejected == rf::QuickScorer::supports(deepForest)) {
+            std::cout << "FAILED: QuickScorer::supports disagrees with the constructor on a depth 12 forest" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::cout << (mismatches == 0 ? "OK" : "FAILED") << ": " << mismatches << " mismatches" << std::endl;
+        if (mismatches > 0) return EXIT_FAILURE;
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -1,4 +1,12 @@
+#include <cstring>
+#include <future>
+#include <filesystem>
+#include <omp.h>
+
 #include "classifier.hpp"
+#include "randomforest.hpp"
+
+namespace fs = std::filesystem;
 
 Regularization parseRegularization(const std::string &regularization) {
     if (regularization == "none") return None;
@@ -16,8 +24,275 @@ ClassifierType fingerprint(const std::string &modelFile) {
 
     ifs.close();
 
+    if (std::memcmp(buf, FLAT_FOREST_MAGIC, sizeof(buf)) == 0) return FlatRandomForest;
+
     return buf[0] == 0x74 && buf[1] == 0x72 && buf[2] == 0x65 && buf[3] == 0x65 ?
         GradientBoostedTrees :
         RandomForest;
 }
 
+// A training file, from reading it to merging its samples
+struct TrainingFile {
+    std::string filename;
+    PointSet *pointSet = nullptr;
+    std::vector<Scale *> scales;
+    std::vector<std::size_t> count;
+    std::vector<std::size_t> added;
+    size_t samplesPerLabel = 0;
+
+    // Base points to train with and their labels
+    std::vector<size_t> selected;
+    std::vector<uint8_t> selectedLabels;
+};
+
+// Consecutive training files processed at the same time
+struct TrainingBatch {
+    std::vector<size_t> files;
+    size_t readBytes = 0; // estimated memory of the files as read
+    size_t bytes = 0; // estimated memory of the files while they are processed
+};
+
+// Group consecutive files into batches whose estimated memory fits
+// TRAINING_BATCH_BYTES, with at most one file per thread. The number of points
+// of a file comes from its header; when unknown, every 12 bytes of the file
+// (the smallest point, three floats) are counted as a point.
+static std::vector<TrainingBatch> planTrainingBatches(const std::vector<std::string> &filenames, const int numScales) {
+    const size_t maxFiles = std::max(1, omp_get_max_threads());
+    std::vector<TrainingBatch> batches;
+
+    for (size_t i = 0; i < filenames.size(); i++) {
+        size_t points = readPointCount(filenames[i]);
+        if (points == 0) {
+            std::error_code ec;
+            const size_t size = fs::file_size(filenames[i], ec);
+            points = ec ? TRAINING_BATCH_BYTES / TRAINING_POINT_BYTES : size / sizeof(std::array<float, 3>);
+        }
+        const size_t readBytes = points * TRAINING_POINT_BYTES;
+        const size_t bytes = readBytes + points * std::max(0, numScales) * TRAINING_SCALE_POINT_BYTES;
+
+        if (batches.empty() || batches.back().files.size() >= maxFiles || batches.back().bytes + bytes > TRAINING_BATCH_BYTES) {
+            batches.emplace_back();
+        }
+        batches.back().files.push_back(i);
+        batches.back().readBytes += readBytes;
+        batches.back().bytes += bytes;
+    }
+
+    return batches;
+}
+
+static std::vector<TrainingFile> readTrainingBatch(const std::vector<std::string> &filenames, const std::vector<size_t> &batch) {
+    std::vector<TrainingFile> files(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        files[i].filename = filenames[batch[i]];
+        /* Read in point set, either from .PLY with built in simplistic parser, or from PDAL-supported format via libPDAL */
+        files[i].pointSet = readPointSet(files[i].filename);
+    }
+    return files;
+}
+
+// Pick the points of a file to train with and compute their features
+static void sampleTrainingFile(TrainingFile &f,
+    const double startResolution,
+    const int numScales,
+    const double radius,
+    const int maxSamples,
+    const size_t numLabels,
+    const bool trainSubset,
+    const std::array<bool, 255> &trainClass) {
+    PointSet *pointSet = f.pointSet;
+
+    //Generate scales, Representation of the point cloud at different zoom-levels
+    f.scales = initScales(numScales, pointSet, startResolution, radius);
+    /* For each scale, Set up a set of features 
+    *  That is: 
+    *       Statistical parameters towards neighbours 
+    *       Colors, 
+    *       etc 
+    *   that is the properties of a point, that will be used as a basis for classification
+    *   TODO for bathy data
+    *     To these features we want to add
+    *       - measured range
+    *       - corrected intensity
+    *       - Angle of incidence for measurement 
+    *       - etc
+    *    TODO
+    *     We also want to remove annything based on color, as that is not relevant for bathy data
+    */
+
+    // One pass over the labels, keeping a uniform sample (reservoir) of up to
+    // maxSamples base points per label. Points sharing a base point count once.
+    const size_t reservoirSize = std::max(0, maxSamples);
+    std::vector<std::vector<size_t> > reservoirs(numLabels);
+    std::vector<bool> sampled(pointSet->base->count(), false);
+    std::random_device rd;
+    std::mt19937 ranGen(rd());
+    f.count.assign(numLabels, 0);
+
+    for (size_t i = 0; i < pointSet->count(); i++) {
+        int g = pointSet->labels[i];
+        if (g != LABEL_UNASSIGNED) {
+            if (trainSubset && !trainClass[g]) continue;
+
+            size_t idx = pointSet->pointMap[i];
+            if (sampled[idx]) continue;
+            sampled[idx] = true;
+
+            const size_t seen = f.count[std::size_t(g)]++;
+            auto &reservoir = reservoirs[std::size_t(g)];
+            if (reservoir.size() < reservoirSize) {
+                reservoir.push_back(idx);
+            }
+            else if (reservoirSize > 0) {
+                const size_t j = std::uniform_int_distribution<size_t>(0, seen)(ranGen);
+                if (j < reservoirSize) reservoir[j] = idx;
+            }
+        }
+    }
+
+    f.samplesPerLabel = std::numeric_limits<size_t>::max();
+    for (std::size_t i = 0; i < numLabels; i++) {
+        if (f.count[i] > 0) f.samplesPerLabel = std::min(f.count[i], f.samplesPerLabel);
+    }
+    f.samplesPerLabel = std::min<size_t>(f.samplesPerLabel, reservoirSize);
+    f.added.assign(numLabels, 0);
+
+    // Take a random subset of samplesPerLabel from each reservoir
+    std::vector<std::pair<size_t, uint8_t> > picks;
+    for (std::size_t g = 0; g < numLabels; g++) {
+        auto &reservoir = reservoirs[g];
+        const size_t n = std::min(f.samplesPerLabel, reservoir.size());
+        for (size_t k = 0; k < n; k++) {
+            const size_t j = std::uniform_int_distribution<size_t>(k, reservoir.size() - 1)(ranGen);
+            std::swap(reservoir[k], reservoir[j]);
+            picks.push_back(std::make_pair(reservoir[k], uint8_t(g)));
+        }
+        f.added[g] = n;
+    }
+
+    // In base point order, for locality when the features are computed
+    std::sort(picks.begin(), picks.end());
+    f.selected.resize(picks.size());
+    f.selectedLabels.resize(picks.size());
+    for (size_t k = 0; k < picks.size(); k++) {
+        f.selected[k] = picks[k].first;
+        f.selectedLabels[k] = picks[k].second;
+    }
+
+    // Features are only needed for the selected points
+    buildScales(f.scales, &f.selected);
+}
+
+void getTrainingData(const std::vector<std::string> &filenames,
+    double *startResolution,
+    const int numScales,
+    const double radius,
+    const int maxSamples,
+    const std::vector<int> &asprsClasses,
+    SampleStore &samples) {
+    auto labels = getTrainingLabels();
+
+    bool trainSubset = asprsClasses.size() > 0;
+    std::array<bool, 255> trainClass;
+
+    if (trainSubset) {
+        trainClass.fill(false);
+
+        auto asprsToTrain = getAsprs2TrainCodes();
+        for (auto &c : asprsClasses) {
+            trainClass[asprsToTrain[c]] = true;
+        }
+    }
+
+    // Files of a batch are processed at the same time (one per thread, nested
+    // loops run serially); a batch of one file gets all threads. The next
+    // batch is read while the current one is processed, if the memory of
+    // both fits TRAINING_BATCH_BYTES.
+    const auto batches = planTrainingBatches(filenames, numScales);
+    if (batches.empty()) return;
+
+    std::future<std::vector<TrainingFile> > reader;
+    size_t filesSampled = 0;
+
+    for (size_t b = 0; b < batches.size(); b++) {
+        std::vector<TrainingFile> files = reader.valid() ? reader.get() : readTrainingBatch(filenames, batches[b].files);
+        if (b + 1 < batches.size() && batches[b].bytes + batches[b + 1].readBytes <= TRAINING_BATCH_BYTES) {
+            reader = std::async(std::launch::async, readTrainingBatch, std::cref(filenames), std::cref(batches[b + 1].files));
+        }
+
+        /* If base resolution (scale) is specified, use this
+        *  if not, calculate it from data (the first labeled file)
+        *      Pick 10k random points
+        *      From these, pick the most frequent RMS 4 neighbour distance as a starting point
+        *      Minimum 1 cm
+        */
+        if (*startResolution == -1.0) {
+            for (auto &f : files) {
+                if (!f.pointSet->hasLabels()) continue;
+                *startResolution = f.pointSet->spacing(); // meters
+                std::cout << "Starting resolution: " << *startResolution << std::endl;
+                break;
+            }
+        }
+
+        for (const auto &f : files) {
+            std::cout << "Processing " << f.filename << std::endl;
+            if (!f.pointSet->hasLabels()) std::cout << f.filename << " has no labels, skipping..." << std::endl;
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1) if (files.size() > 1)
+        for (long long int i = 0; i < files.size(); i++) {
+            if (!files[i].pointSet->hasLabels()) continue;
+            sampleTrainingFile(files[i], *startResolution, numScales, radius, maxSamples, labels.size(), trainSubset, trainClass);
+        }
+
+        // Reserve the rows of the batch before they are merged, along with
+        // as many rows per file for the files still to come as the files so
+        // far added on average, so that the rows are rarely moved. Reserved
+        // rows that are never added cost address space, not memory.
+        size_t batchRows = 0;
+        for (const auto &f : files) {
+            if (f.pointSet->hasLabels()) batchRows += f.selected.size();
+        }
+        filesSampled += files.size();
+        const size_t sampledRows = samples.rows() + batchRows;
+        const size_t projectedRows = static_cast<size_t>(std::ceil(static_cast<double>(sampledRows) * filenames.size() / filesSampled));
+
+        // Merge in file order
+        for (auto &f : files) {
+            if (!f.pointSet->hasLabels()) {
+                RELEASE_POINTSET(f.pointSet);
+                continue;
+            }
+
+            if (files.size() > 1) std::cout << "Samples of " << f.filename << std::endl;
+            const FeatureMatrix features(f.scales);
+            std::cout << "Features: " << features.cols() << std::endl;
+            std::cout << "Labels: " << labels.size() << std::endl;
+            std::cout << "Samples per label: " << f.samplesPerLabel << std::endl;
+
+            if (samples.cols() == 0) samples.init(features.cols());
+            if (batchRows > 0) {
+                samples.reserve(projectedRows);
+                batchRows = 0;
+            }
+
+            // Rows are filled in place
+            const size_t numFeatures = features.cols();
+            float *rows = samples.append(f.selectedLabels.data(), f.selected.size());
+
+            #pragma omp parallel for schedule(static)
+            for (long long int i = 0; i < f.selected.size(); i++) {
+                features.fill(f.selected[i], f.selected[i] + 1, rows + i * numFeatures);
+            }
+
+            for (std::size_t i = 0; i < labels.size(); i++)
+                std::cout << " * " << labels[i].getName() << ": " << f.added[i] << " / " << f.count[i] << std::endl;
+
+            // Free up memory for next
+            for (size_t i = 0; i < f.scales.size(); i++) delete f.scales[i];
+            RELEASE_POINTSET(f.pointSet);
+        }
+    }
+}
+
@@ -10,139 +10,44 @@
 #include "constants.hpp"
 #include "point_io.hpp"
 #include "statistics.hpp"
+#include "samplestore.hpp"
 
 enum Regularization { None, LocalSmooth };
 Regularization parseRegularization(const std::string &regularization);
 
-enum ClassifierType { RandomForest, GradientBoostedTrees };
+enum ClassifierType { RandomForest, FlatRandomForest, GradientBoostedTrees };
 ClassifierType fingerprint(const std::string &modelFile);
 
 
-template <typename F, typename I>
+// Training files are processed at the same time (one per thread) while their
+// estimated memory fits this budget; larger files are processed one at a time.
+// The next batch is read during the current one if both fit the budget.
+#define TRAINING_BATCH_BYTES (size_t(2) << 30)
+
+// Estimated memory per point of a training file: as read (positions, colors,
+// normals, labels), and per scale once its features are computed (the features
+// of each base point, see Scale::init, the scaled point set, its index and
+// neighbor graphs). Measured peak memory is about 280 bytes per point with one
+// scale and 850 with five.
+#define TRAINING_POINT_BYTES 96
+#define TRAINING_SCALE_POINT_BYTES 160
+
+// Compute the features of the labeled points of each file and append a
+// class-balanced sample of them (at most maxSamples per label and file) to samples
 void getTrainingData(const std::vector<std::string> &filenames,
     double *startResolution,
     const int numScales,
     const double radius,
     const int maxSamples,
     const std::vector<int> &asprsClasses,
-    F storeFeatures,
-    I init) {
-    auto labels = getTrainingLabels();
-
-    bool trainSubset = asprsClasses.size() > 0;
-    std::array<bool, 255> trainClass;
-
-    if (trainSubset) {
-        trainClass.fill(false);
-
-        auto asprsToTrain = getAsprs2TrainCodes();
-        for (auto &c : asprsClasses) {
-            trainClass[asprsToTrain[c]] = true;
-        }
-    }
-
-    for (size_t file_ix = 0; file_ix < filenames.size(); file_ix++) {
-        std::cout << "Processing " << filenames[file_ix] << std::endl;
-        /* Read in point set, either from .PLY with built in simplistic parser, or from PDAL-supported format via libPDAL */  
-        auto pointSet = readPointSet(filenames[file_ix]);
-        if (!pointSet->hasLabels()) {
-            std::cout << filenames[file_ix] << " has no labels, skipping..." << std::endl;
-            continue;
-        }
-
-        for (size_t i = 0; i < pointSet->count(); i++) {
-            //int g = pointSet->labels[i];
-            //std::cout << std::to_string(pointSet->labels[i]) <<",";
-        }
-        /* If base resolution (scale) is specified, use this
-        *  if not, calculate it from data
-        *      Pick 10k random points
-        *      From these, pick the most frequent RMS 4 neighbour distance as a starting point
-        *      Minimum 1 cm
-        */
-        if (*startResolution == -1.0) {
-            *startResolution = pointSet->spacing(); // meters
-            std::cout << "Starting resolution: " << *startResolution << std::endl;
-        }
-
-        //Generate scales, Representation of the point cloud at different zoom-levels
-        auto scales = computeScales(numScales, pointSet, *startResolution, radius);
-        /* For each scale, Set up a set of features 
-        *  That is: 
-        *       Statistical parameters towards neighbours 
-        *       Colors, 
-        *       etc 
-        *   that is the properties of a point, that will be used as a basis for classification
-        *   TODO for bathy data
-        *     To these features we want to add
-        *       - measured range
-        *       - corrected intensity
-        *       - Angle of incidence for measurement 
-        *       - etc
-        *    TODO
-        *     We also want to remove annything based on color, as that is not relevant for bathy data
-        */
-        auto features = getFeatures(scales);
-        std::cout << "Features: " << features.size() << std::endl;
-        std::cout << "Labels: " << labels.size() << std::endl;
-
-        if (file_ix == 0) init(features.size(), labels.size());
-
-        std::vector<std::size_t> count(labels.size(), 0);
-        std::vector<bool> sampled(pointSet->count(), false);
-        std::vector<std::pair<size_t, int> > idxes;
-
-        for (size_t i = 0; i < pointSet->count(); i++) {
-            int g = pointSet->labels[i];
-            //std::cout << std::to_string(g) <<",";
-            if (g != LABEL_UNASSIGNED) {
-                if (trainSubset && !trainClass[g]) continue;
-
-                size_t idx = pointSet->pointMap[i];
-                if (!sampled[idx]) {
-                    idxes.push_back(std::make_pair(idx, g));
-                    count[std::size_t(g)]++;
-                    sampled[idx] = true;
-                }
-            }
-        }
-
-        size_t samplesPerLabel = std::numeric_limits<size_t>::max();
-        for (std::size_t i = 0; i < labels.size(); i++) {
-            if (count[i] > 0) samplesPerLabel = std::min(count[i], samplesPerLabel);
-        }
-        samplesPerLabel = std::min<size_t>(samplesPerLabel, maxSamples);
-        std::vector<std::size_t> added(labels.size(), 0);
-
-        std::cout << "Samples per label: " << samplesPerLabel << std::endl;
-
-        std::random_device rd;
-        std::mt19937 ranGen(rd());
-        std::shuffle(idxes.begin(), idxes.end(), ranGen);
-
-        for (const auto &p : idxes) {
-            size_t idx = p.first;
-            int g = p.second;
-            if (added[std::size_t(g)] < samplesPerLabel) {
-                storeFeatures(features, idx, g);
-                added[std::size_t(g)]++;
-            }
-        }
-
-        for (std::size_t i = 0; i < labels.size(); i++)
-            std::cout << " * " << labels[i].getName() << ": " << added[i] << " / " << count[i] << std::endl;
-
-        // Free up memory for next
-        for (size_t i = 0; i < scales.size(); i++) delete scales[i];
-        for (size_t i = 0; i < features.size(); i++) delete features[i];
-        RELEASE_POINTSET(pointSet);
-    }
-}
+    SampleStore &samples);
 
+// evaluateFunc(features, count, probs) computes the class probabilities of
+// count consecutive feature rows (row-major, one row per point)
 template <typename T, typename F>
 void classifyData(PointSet &pointSet,
     F evaluateFunc,
-    const std::vector<Feature *> &features,
+    const FeatureMatrix &features,
     const std::vector<Label> &labels,
     const Regularization regularization,
     const double regRadius,
@@ -155,32 +60,37 @@ void classifyData(PointSet &pointSet,
     std::cout << "Classifying..." << std::endl;
     pointSet.base->labels.resize(pointSet.base->count());
 
+    const long long int numPoints = pointSet.base->count();
+    const size_t numFeatures = features.cols();
+
     if (regularization == Regularization::None) {
         #pragma omp parallel
         {
-            std::vector<T> probs(labels.size(), 0.);
-            std::vector<T> ft(features.size());
-
-            #pragma omp for
-            for (long long int i = 0; i < pointSet.base->count(); i++) {
-                for (std::size_t f = 0; f < features.size(); f++) {
-                    ft[f] = features[f]->getValue(i);
-                }
-
-                evaluateFunc(ft.data(), probs.data());
+            std::vector<T> probs(FEATURE_BLOCK * labels.size(), 0.);
+            std::vector<T> ft(FEATURE_BLOCK * numFeatures);
 
-                // Find highest probability
-                int bestClass = 0;
-                T bestClassVal = 0.;
-
-                for (std::size_t j = 0; j < probs.size(); j++) {
-                    if (probs[j] > bestClassVal) {
-                        bestClass = j;
-                        bestClassVal = probs[j];
+            #pragma omp for schedule(dynamic, 1)
+            for (long long int block = 0; block < numPoints; block += FEATURE_BLOCK) {
+                const size_t end = std::min<size_t>(numPoints, block + FEATURE_BLOCK);
+                features.fill(block, end, ft.data());
+                evaluateFunc(ft.data(), end - block, probs.data());
+
+                for (size_t i = block; i < end; i++) {
+                    const T *p = probs.data() + (i - block) * labels.size();
+
+                    // Find highest probability
+                    int bestClass = 0;
+                    T bestClassVal = 0.;
+
+                    for (std::size_t j = 0; j < labels.size(); j++) {
+                        if (p[j] > bestClassVal) {
+                            bestClass = j;
+                            bestClassVal = p[j];
+                        }
                     }
-                }
 
-                pointSet.base->labels[i] = bestClass;
+                    pointSet.base->labels[i] = bestClass;
+                }
             }
         } // end pragma omp
 
@@ -191,19 +101,19 @@ void classifyData(PointSet &pointSet,
         #pragma omp parallel
         {
 
-            std::vector<T> probs(labels.size(), 0.);
-            std::vector<T> ft(features.size());
-
-            #pragma omp for
-            for (long long int i = 0; i < pointSet.base->count(); i++) {
-                for (std::size_t f = 0; f < features.size(); f++) {
-                    ft[f] = features[f]->getValue(i);
-                }
-
-                evaluateFunc(ft.data(), probs.data());
+            std::vector<T> probs(FEATURE_BLOCK * labels.size(), 0.);
+            std::vector<T> ft(FEATURE_BLOCK * numFeatures);
 
-                for (std::size_t j = 0; j < labels.size(); j++) {
-                    values[j][i] = probs[j];
+            #pragma omp for schedule(dynamic, 1)
+            for (long long int block = 0; block < numPoints; block += FEATURE_BLOCK) {
+                const size_t end = std::min<size_t>(numPoints, block + FEATURE_BLOCK);
+                features.fill(block, end, ft.data());
+                evaluateFunc(ft.data(), end - block, probs.data());
+
+                for (size_t i = block; i < end; i++) {
+                    for (std::size_t j = 0; j < labels.size(); j++) {
+                        values[j][i] = probs[(i - block) * labels.size() + j];
+                    }
                 }
             }
 
@@ -211,22 +121,47 @@ void classifyData(PointSet &pointSet,
 
         std::cout << "Local smoothing..." << std::endl;
 
+        // The neighbors of the first scale's radius graph (of the base points,
+        // sorted by distance) include those within regRadius when it is not
+        // larger: filter them instead of searching again
+        const float searchRadius = static_cast<float>(regRadius);
+        const auto &scales = features.getScales();
+        const NeighborGraph *graph = !scales.empty() && scales[0]->scaledSet == pointSet.base &&
+            scales[0]->radiusGraph.count() == pointSet.base->count() && scales[0]->radiusGraph.param >= searchRadius ?
+            &scales[0]->radiusGraph : nullptr;
+
+        // Otherwise search the kd-tree (built before the threads start)
+        const KdTree *index = graph == nullptr ? pointSet.base->getIndex<KdTree>() : nullptr;
+
         #pragma omp parallel
         {
 
             std::vector<nanoflann::ResultItem<size_t, float>> radiusMatches;
             std::vector<T> mean(values.size(), 0.);
-            const auto index = pointSet.base->getIndex<KdTree>();
+            const nanoflann::L2_Simple_Adaptor<float, PointSet> metric(*pointSet.base);
 
             #pragma omp for schedule(dynamic, 1)
             for (long long int i = 0; i < pointSet.base->count(); i++) {
-                size_t numMatches = index->radiusSearch(&pointSet.base->points[i][0], regRadius, radiusMatches);
+                const float *p = &pointSet.base->points[i][0];
+                size_t numMatches = 0;
                 std::fill(mean.begin(), mean.end(), 0.);
 
-                for (size_t n = 0; n < numMatches; n++) {
+                auto add = [&values, &mean, &numMatches](const size_t n) {
                     for (std::size_t j = 0; j < values.size(); ++j) {
-                        mean[j] += values[j][radiusMatches[n].first];
+                        mean[j] += values[j][n];
                     }
+                    numMatches++;
+                };
+
+                if (graph != nullptr) {
+                    const uint32_t *neighbors = graph->neighbors(i);
+                    for (size_t n = 0; n < graph->size(i); n++) {
+                        if (metric.evalMetric(p, neighbors[n], 3) < searchRadius) add(neighbors[n]);
+                    }
+                }
+                else {
+                    const size_t found = index->radiusSearch(p, searchRadius, radiusMatches);
+                    for (size_t n = 0; n < found; n++) add(radiusMatches[n].first);
                 }
 
                 int bestClass = 0;
@@ -5,6 +5,7 @@
 #define N_TREES 50
 #define MAX_DEPTH 30
 #define RADIUS 0.6
+#define K_NEIGHBORS 10
 
 #define __MKSTR(s) #s
 #define MKSTR(s) __MKSTR(s)
@@ -1,37 +1,62 @@
 #include "features.hpp"
 
-std::vector<Feature *> getFeatures(const std::vector<Scale *> &scales) {
-    std::vector<Feature *> feats;
-
-    for (size_t i = 0; i < scales.size(); i++) {
-        // Covariance
-        feats.push_back(reinterpret_cast<Feature *>(new Omnivariance(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new Eigenentropy(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new Anisotropy(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new Planarity(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new Linearity(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new SurfaceVariation(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new Scatter(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new Verticality(scales[i])));
-
-        // Moments
-        feats.push_back(reinterpret_cast<Feature *>(new OrderAxis(scales[i], 1, 1)));
-        feats.push_back(reinterpret_cast<Feature *>(new OrderAxis(scales[i], 1, 2)));
-        feats.push_back(reinterpret_cast<Feature *>(new OrderAxis(scales[i], 2, 1)));
-        feats.push_back(reinterpret_cast<Feature *>(new OrderAxis(scales[i], 2, 2)));
-
-        // Height
-        feats.push_back(reinterpret_cast<Feature *>(new VerticalRange(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new HeightBelow(scales[i])));
-        feats.push_back(reinterpret_cast<Feature *>(new HeightAbove(scales[i])));
-
-        // Color (using data from first scale only)
-        for (size_t c = 0; c < 3; c++) {
-            feats.push_back(reinterpret_cast<Feature *>(new PointColor(scales[0], c)));
-            feats.push_back(reinterpret_cast<Feature *>(new NeighborhoodColors(scales[0], c)));
+template <typename T>
+void FeatureMatrix::fill(const size_t begin, const size_t end, T *out) const {
+    const size_t stride = cols();
+    const Eigen::Vector3f up(0, 0, 1);
+
+    for (size_t k = 0; k < scales.size(); k++) {
+        const Scale *s = scales[k];
+        T *row = out + k * FEATURES_PER_SCALE;
+
+        for (size_t i = begin; i < end; i++, row += stride) {
+            const Eigen::Vector3f &ev = s->eigenValues[i];
+
+            // Covariance
+            float entropy = 0;
+            for (size_t j = 0; j < 3; j++) entropy += ev[j] * std::log(ev[j]);
+
+            row[0] = std::cbrt(ev[0] * ev[1] * ev[2]);
+            row[1] = -entropy;
+            row[2] = (ev[2] - ev[0]) / ev[2];
+            row[3] = (ev[1] - ev[0]) / ev[2];
+            row[4] = (ev[2] - ev[1]) / ev[2];
+            row[5] = ev[0];
+            row[6] = ev[0] / ev[2];
+            row[7] = 1.0f - std::fabs(up.dot(s->eigenVectors[i].col(0)));
+
+            // Moments
+            const Eigen::Matrix2f &oa = s->orderAxis[i];
+            row[8] = oa(0, 0);
+            row[9] = oa(0, 1);
+            row[10] = oa(1, 0);
+            row[11] = oa(1, 1);
+
+            // Height
+            const float z = s->pSet->points[i][2];
+            row[12] = s->heightMax[i] - s->heightMin[i];
+            row[13] = z - s->heightMin[i];
+            row[14] = s->heightMax[i] - z;
         }
     }
 
+    // Color (using data from first scale only, repeated for every scale)
+    if (scales.empty()) return;
+    const Scale *s = scales[0];
+    T *row = out;
+
+    for (size_t i = begin; i < end; i++, row += stride) {
+        const auto &rgb = s->pSet->colors[i];
+        const auto hsv = rgb2hsv(rgb[0], rgb[1], rgb[2]);
+
+        for (size_t k = 0; k < scales.size(); k++) {
+            for (size_t c = 0; c < 3; c++) {
+                row[k * FEATURES_PER_SCALE + 15 + 2 * c] = hsv[c];
+                row[k * FEATURES_PER_SCALE + 16 + 2 * c] = s->avgHsv[i][c];
+            }
+        }
+    }
+}
 
-    return feats;
-}
\ No newline at end of file
+template void FeatureMatrix::fill<float>(size_t begin, size_t end, float *out) const;
+template void FeatureMatrix::fill<double>(size_t begin, size_t end, double *out) const;
@@ -4,196 +4,38 @@
 #include <Eigen/Dense>
 #include "scale.hpp"
 
-class Feature {
-protected:
-    std::string name;
-    Scale *s = nullptr;
-public:
-    Feature(Scale *s) : s(s) {};
-    virtual ~Feature() {};
-
-    virtual float getValue(size_t i) = 0;
-    std::string getName() const { return name; }
-
-    void setName(const std::string &name) {
-        this->name = name + "_" + std::to_string(s->id);
-    }
-
-    Scale *getScale() { return s; }
-};
-
-class Omnivariance : public Feature {
-public:
-    Omnivariance(Scale *s) : Feature(s) {
-        this->setName("omnivariance");
-    };
-    virtual float getValue(std::size_t i) {
-        return std::cbrt(s->eigenValues[i][0] *
-            s->eigenValues[i][1] *
-            s->eigenValues[i][2]);
-    }
-};
-
-class Eigenentropy : public Feature {
-public:
-    Eigenentropy(Scale *s) : Feature(s) {
-        this->setName("eigenentropy");
-    };
-    virtual float getValue(std::size_t i) {
-        float sum = 0;
-        for (std::size_t j = 0; j < 3; j++) {
-            float l = s->eigenValues[i][j];
-            sum += l * std::log(l);
-        }
-        return -sum;
-    }
-};
-
-
-class Anisotropy : public Feature {
-public:
-    Anisotropy(Scale *s) : Feature(s) {
-        this->setName("anisotropy");
-    };
-    virtual float getValue(std::size_t i) {
-        return (s->eigenValues[i][2] -
-            s->eigenValues[i][0]) / s->eigenValues[i][2];
-    }
-};
-
-class Planarity : public Feature {
-public:
-    Planarity(Scale *s) : Feature(s) {
-        this->setName("planarity");
-    };
-    virtual float getValue(std::size_t i) {
-        return (s->eigenValues[i][1] -
-            s->eigenValues[i][0]) / s->eigenValues[i][2];
-    }
-};
-
-class Linearity : public Feature {
-public:
-    Linearity(Scale *s) : Feature(s) {
-        this->setName("linearity");
-    };
-    virtual float getValue(std::size_t i) {
-        return (s->eigenValues[i][2] -
-            s->eigenValues[i][1]) / s->eigenValues[i][2];
-    }
-};
-
-class SurfaceVariation : Feature {
-public:
-    SurfaceVariation(Scale *s) : Feature(s) {
-        this->setName("surface_variation");
-    };
-
-    virtual float getValue(size_t i) {
-        return s->eigenValues[i][0];
-    }
-};
-
-class Scatter : Feature {
-public:
-    Scatter(Scale *s) : Feature(s) {
-        this->setName("scatter");
-    };
-
-    virtual float getValue(size_t i) {
-        return s->eigenValues[i][0] / s->eigenValues[i][2];
-    }
-};
-
-class Verticality : Feature {
-    Eigen::Vector3f up;
-public:
-    Verticality(Scale *s) : Feature(s), up(0, 0, 1) {
-        this->setName("verticality");
-    };
-
-    virtual float getValue(size_t i) {
-        return 1.0f - std::fabs(up.dot(s->eigenVectors[i].col(0)));
-    }
-};
-
-class OrderAxis : Feature {
-    size_t order;
-    size_t axis;
-public:
-    OrderAxis(Scale *s, size_t order, size_t axis)
-        : Feature(s), order(order), axis(axis) {
-        this->setName("order_" + std::to_string(order) + "_axis_" + std::to_string(axis));
-    };
-
-    virtual float getValue(size_t i) {
-        return s->orderAxis[i](order - 1, axis - 1);
-    }
-};
-
-class VerticalRange : Feature {
-public:
-    VerticalRange(Scale *s) : Feature(s) {
-        this->setName("vertical_range");
-    };
-
-    virtual float getValue(size_t i) {
-        return s->heightMax[i] - s->heightMin[i];
-    }
-};
-
-class HeightBelow : Feature {
-public:
-    HeightBelow(Scale *s) : Feature(s) {
-        this->setName("height_below");
-    };
-
-    virtual float getValue(size_t i) {
-        return s->pSet->points[i][2] - s->heightMin[i];
-    }
-};
-
-class HeightAbove : Feature {
-public:
-    HeightAbove(Scale *s) : Feature(s) {
-        this->setName("height_above");
-    };
-
-    virtual float getValue(size_t i) {
-        return s->heightMax[i] - s->pSet->points[i][2];
-    }
-};
-
-class PointColor : Feature {
-private:
-    size_t componentIdx;
-public:
-    PointColor(Scale *s, size_t componentIdx) : Feature(s), componentIdx(componentIdx) {
-        this->setName("point_color_" + std::to_string(componentIdx));
-    };
-
-    virtual float getValue(size_t i) {
-        double r = s->pSet->colors[i][0];
-        double g = s->pSet->colors[i][1];
-        double b = s->pSet->colors[i][2];
-        auto hsv = rgb2hsv(r, g, b);
-        return hsv[componentIdx];
-    }
-};
-
-class NeighborhoodColors : Feature {
-private:
-    size_t componentIdx;
-public:
-    NeighborhoodColors(Scale *s, size_t componentIdx) : Feature(s), componentIdx(componentIdx) {
-        this->setName("neighborhood_colors_" + std::to_string(componentIdx));
-    };
-
-    virtual float getValue(size_t i) {
-        return s->avgHsv[i][componentIdx];
-    }
-};
-
-std::vector<Feature *> getFeatures(const std::vector<Scale *> &scales);
-
-#endif
\ No newline at end of file
+// Features computed for each scale (see FeatureMatrix::fill for the layout)
+#define FEATURES_PER_SCALE 21
+
+// Number of rows filled at once by classification loops
+#define FEATURE_BLOCK 256
+
+// Columnar view over the features of all scales. Rows are base points,
+// columns are the FEATURES_PER_SCALE features of each scale in turn:
+//
+//  0 omnivariance       8 order_1_axis_1   12 vertical_range
+//  1 eigenentropy       9 order_1_axis_2   13 height_below
+//  2 anisotropy        10 order_2_axis_1   14 height_above
+//  3 planarity         11 order_2_axis_2   15 + 2c point_color_c (c = 0..2)
+//  4 linearity                             16 + 2c neighborhood_colors_c
+//  5 surface_variation
+//  6 scatter
+//  7 verticality
+//
+// Colors always come from the first scale. This is the layout models are
+// trained with, so it must not change.
+class FeatureMatrix {
+    std::vector<Scale *> scales;
+public:
+    explicit FeatureMatrix(const std::vector<Scale *> &scales) : scales(scales) {}
+
+    size_t cols() const { return scales.size() * FEATURES_PER_SCALE; }
+    size_t rows() const { return scales.empty() ? 0 : scales[0]->pSet->count(); }
+    const std::vector<Scale *> &getScales() const { return scales; }
+
+    // Write rows [begin, end) to out, row-major (cols() values per row)
+    template <typename T>
+    void fill(size_t begin, size_t end, T *out) const;
+};
+
+#endif
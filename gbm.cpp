@@ -2,6 +2,8 @@
 #include <random>
 #include <algorithm>
 
+#include <LightGBM/c_api.h>
+
 #include "classifier.hpp"
 #include "gbm.hpp"
 
@@ -14,62 +16,36 @@ Boosting *train(const std::vector<std::string> &filenames,
     const int treeDepth,
     const double radius,
     const int maxSamples,
-    const std::vector<int> &classes) {
-
-    std::vector<float> gt;
-    std::vector< std::vector<double> > featureRows;
-    std::vector< std::vector<double> > featuresData;
-    std::vector< std::vector<int> > featuresIdx;
-    size_t numFeats;
-    int numClass;
-
-    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes,
-        [&featureRows, &featuresData, &featuresIdx, &gt](const std::vector<Feature *> &features, const size_t idx, const int g) {
-            const size_t row = featureRows.size();
-            featureRows.emplace_back();
-            featureRows[row].resize(features.size(), 0);
-            for (std::size_t f = 0; f < features.size(); f++) {
-                featureRows[row][f] = features[f]->getValue(idx);
-                featuresData[f].push_back(featureRows[row][f]);
-                featuresIdx[f].push_back(row);
-            }
-            gt.push_back(g);
-        },
-        [&numFeats, &numClass, &featuresData, &featuresIdx](const size_t numFeatures, const int numClasses) {
-            numFeats = numFeatures;
-            numClass = numClasses;
-            featuresData.resize(numFeats);
-            featuresIdx.resize(numFeats);
-        });
-
-    const size_t numRows = gt.size();
+    const std::vector<int> &classes,
+    const size_t sampleMemory) {
+
+    SampleStore samples(sampleMemory);
+    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes, samples);
+
+    const size_t numRows = samples.rows();
+    if (numRows == 0) throw std::runtime_error("No training samples");
     std::cout << "Using " << numRows << " inliers" << std::endl;
 
-    LightGBM::Config ioconfig;
-    ioconfig.num_class = numClass;
-    ioconfig.max_bin = 255;
-
-    std::unique_ptr<LightGBM::Dataset> dset;
-    LightGBM::DatasetLoader loader(ioconfig, nullptr, numClass, nullptr);
-    dset.reset(loader.ConstructFromSampleData(LightGBM::Common::Vector2Ptr<double>(&featuresData).data(),
-        LightGBM::Common::Vector2Ptr<int>(&featuresIdx).data(),
-        numFeats,
-        LightGBM::Common::VectorSize<double>(featuresData).data(),
-        numRows,
-        numRows,
-        numRows));
-
-    #pragma omp parallel for schedule(static)
-    for (long long int i = 0; i < numRows; ++i) {
-        dset->PushOneRow(omp_get_thread_num(), i, featureRows[i]);
-    }
+    const int numClass = getTrainingLabels().size();
+
+    // LightGBM bins and loads the float32 rows of the store directly. Bin
+    // boundaries are found from all rows, not a subsample of them. (num_class
+    // is set on the boosting config: the C API rejects it here without a
+    // multiclass objective.)
+    std::stringstream dsetParams;
+    dsetParams << "max_bin=255 bin_construct_sample_cnt=" << numRows;
 
-    dset->FinishLoad();
+    DatasetHandle handle = nullptr;
+    if (LGBM_DatasetCreateFromMat(samples.features(), C_API_DTYPE_FLOAT32,
+            static_cast<int32_t>(numRows), static_cast<int32_t>(samples.cols()), 1,
+            dsetParams.str().c_str(), nullptr, &handle) != 0) {
+        throw std::runtime_error(std::string("Cannot create dataset: ") + LGBM_GetLastError());
+    }
+    std::unique_ptr<LightGBM::Dataset> dset(reinterpret_cast<LightGBM::Dataset *>(handle));
 
     /*
         for(int j = 0; j < numFeats; j++){
             const auto nbins = dset->FeatureBinMapper(j)->num_bin();
-            // std::cout << features[j]->getName() << std::endl;
             std::cout << "Feat " << j << std::endl;
             std::cout << "   " << dset->FeatureBinMapper(j)->BinToValue(0) << " ";
             std::cout << "   " << dset->FeatureBinMapper(j)->BinToValue(nbins-2) << " ";
@@ -77,6 +53,7 @@ Boosting *train(const std::vector<std::string> &filenames,
         }
     */
 
+    const std::vector<float> gt(samples.labels(), samples.labels() + numRows);
     if (!dset->SetFloatField("label", gt.data(), numRows)) {
         throw std::runtime_error("Error setting label");
     }
@@ -163,7 +140,7 @@ BoosterParams extractBoosterParams(Boosting *booster) {
 
 void classify(PointSet &pointSet,
     Boosting *booster,
-    const std::vector<Feature *> &features,
+    const FeatureMatrix &features,
     const std::vector<Label> &labels,
     const Regularization regularization,
     const double regRadius,
@@ -177,9 +154,14 @@ void classify(PointSet &pointSet,
     LightGBM::PredictionEarlyStopConfig early_stop_config;
     auto earlyStop = LightGBM::CreatePredictionEarlyStopInstance("none", early_stop_config);
 
+    const size_t numFeatures = features.cols();
+    const size_t numClasses = labels.size();
+
     classifyData<double>(pointSet,
-        [&booster, &earlyStop](const double *ft, double *probs) {
-            booster->Predict(ft, probs, &earlyStop);
+        [&booster, &earlyStop, numFeatures, numClasses](const double *ft, const size_t count, double *probs) {
+            for (size_t i = 0; i < count; i++) {
+                booster->Predict(ft + i * numFeatures, probs + i * numClasses, &earlyStop);
+            }
         },
         features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile);
 }
@@ -28,7 +28,8 @@ Boosting *train(const std::vector<std::string> &filenames,
     int treeDepth,
     double radius,
     int maxSamples,
-    const std::vector<int> &classes
+    const std::vector<int> &classes,
+    size_t sampleMemory = 0
 );
 
 struct BoosterParams {
@@ -44,7 +45,7 @@ BoosterParams extractBoosterParams(Boosting *booster);
 
 void classify(PointSet &pointSet,
     Boosting *booster,
-    const std::vector<Feature *> &features,
+    const FeatureMatrix &features,
     const std::vector<Label> &labels,
     Regularization regularization = Regularization::None,
     double regRadius = 2.5,
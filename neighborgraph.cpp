@@ -0,0 +1,231 @@
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <omp.h>
+
+#include "neighborgraph.hpp"
+
+// Run a search for every query in parallel and lay the results out in CSR
+// order. makeSearch() is called once per thread and returns a function
+// search(i, out) that appends the neighbors of query i to out.
+template <typename F>
+static void buildGraph(NeighborGraph &g, const size_t numQueries, F makeSearch) {
+    g.offsets.assign(numQueries + 1, 0);
+
+    // With a static schedule each thread gets one contiguous range of queries
+    std::vector<std::vector<uint32_t> > parts(omp_get_max_threads());
+    std::vector<size_t> firsts(parts.size(), numQueries);
+
+    #pragma omp parallel
+    {
+        const int t = omp_get_thread_num();
+        auto search = makeSearch();
+        auto &part = parts[t];
+
+        #pragma omp for schedule(static)
+        for (long long int i = 0; i < numQueries; i++) {
+            if (firsts[t] == numQueries) firsts[t] = i;
+            const size_t before = part.size();
+            search(i, part);
+            g.offsets[i + 1] = part.size() - before;
+        }
+    }
+
+    for (size_t i = 0; i < numQueries; i++) g.offsets[i + 1] += g.offsets[i];
+    g.ids.resize(g.offsets[numQueries]);
+
+    #pragma omp parallel for
+    for (long long int t = 0; t < parts.size(); t++) {
+        if (!parts[t].empty()) std::memcpy(g.ids.data() + g.offsets[firsts[t]], parts[t].data(), parts[t].size() * sizeof(uint32_t));
+    }
+}
+
+static void checkTarget(const PointSet &target) {
+    if (target.count() == 0) throw std::runtime_error("Cannot search neighbors in an empty point set");
+    if (target.count() > std::numeric_limits<uint32_t>::max()) throw std::runtime_error("Too many points for a neighbor graph");
+}
+
+void NeighborGraph::knn(const PointSet &queries, PointSet &target, const int k, const std::vector<size_t> *subset) {
+    checkTarget(target);
+    search = KnnSearch;
+    param = k;
+    targetCount = target.count();
+
+    const KdTree *index = target.getIndex<KdTree>();
+    const size_t numQueries = subset != nullptr ? subset->size() : queries.count();
+
+    buildGraph(*this, numQueries, [&]() {
+        return [&, neighborIds = std::vector<size_t>(k), sqrDists = std::vector<float>(k)](const size_t i, std::vector<uint32_t> &out) mutable {
+            const size_t idx = subset != nullptr ? (*subset)[i] : i;
+            const size_t found = index->knnSearch(queries.points[idx].data(), k, neighborIds.data(), sqrDists.data());
+            for (size_t j = 0; j < k; j++) out.push_back(static_cast<uint32_t>(neighborIds[std::min(j, found - 1)]));
+        };
+    });
+}
+
+void NeighborGraph::knn(const PointSet &queries, PointSet &target, const int k, const VoxelGrid &grid) {
+    const size_t numCandidates = std::min<size_t>(KNN_HIERARCHY_CANDIDATES * k, target.count());
+    if (numCandidates <= k || grid.count() != target.count()) {
+        knn(queries, target, k);
+        return;
+    }
+
+    checkTarget(target);
+    search = KnnSearch;
+    param = k;
+    targetCount = target.count();
+
+    const KdTree *index = target.getIndex<KdTree>();
+    const size_t numQueries = queries.count();
+    const nanoflann::L2_Simple_Adaptor<float, PointSet> metric(target);
+
+    // Every query has exactly k neighbors
+    offsets.resize(numQueries + 1);
+    for (size_t i = 0; i <= numQueries; i++) offsets[i] = i * k;
+    ids.resize(numQueries * k);
+
+    #pragma omp parallel
+    {
+        std::vector<size_t> candidateIds(numCandidates);
+        std::vector<float> candidateDists(numCandidates);
+        std::vector<std::pair<float, uint32_t> > candidates(numCandidates);
+        std::vector<size_t> neighborIds(k);
+        std::vector<float> sqrDists(k);
+
+        #pragma omp for schedule(dynamic, 64)
+        for (long long int v = 0; v < grid.count(); v++) {
+            const auto &center = target.points[v];
+            index->knnSearch(center.data(), numCandidates, candidateIds.data(), candidateDists.data());
+
+            // Target points closer than this to the center are all candidates
+            const float reach = numCandidates == target.count() ?
+                std::numeric_limits<float>::infinity() :
+                std::sqrt(candidateDists[numCandidates - 1]) * 0.9999f;
+
+            const size_t *children = grid.points(v);
+            for (size_t c = 0; c < grid.size(v); c++) {
+                const size_t q = children[c];
+                const auto &p = queries.points[q];
+                uint32_t *out = ids.data() + q * k;
+
+                for (size_t j = 0; j < numCandidates; j++) {
+                    candidates[j] = std::make_pair(metric.evalMetric(p.data(), candidateIds[j], 3), static_cast<uint32_t>(candidateIds[j]));
+                }
+                std::partial_sort(candidates.begin(), candidates.begin() + k + 1, candidates.end(),
+                    [](const std::pair<float, uint32_t> &a, const std::pair<float, uint32_t> &b) { return a.first < b.first; });
+
+                const float dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+                bool exact = std::sqrt(dx * dx + dy * dy + dz * dz) + std::sqrt(candidates[k - 1].first) < reach;
+                for (size_t j = 1; exact && j <= k; j++) exact = candidates[j].first != candidates[j - 1].first;
+
+                if (exact) {
+                    for (size_t j = 0; j < k; j++) out[j] = candidates[j].second;
+                }
+                else {
+                    const size_t found = index->knnSearch(p.data(), k, neighborIds.data(), sqrDists.data());
+                    for (size_t j = 0; j < k; j++) out[j] = static_cast<uint32_t>(neighborIds[std::min(j, found - 1)]);
+                }
+            }
+        }
+    }
+}
+
+void NeighborGraph::radius(const PointSet &queries, PointSet &target, const float radius, const std::vector<size_t> *subset) {
+    checkTarget(target);
+    search = RadiusSearch;
+    param = radius;
+    targetCount = target.count();
+
+    const KdTree *index = target.getIndex<KdTree>();
+    const size_t numQueries = subset != nullptr ? subset->size() : queries.count();
+
+    buildGraph(*this, numQueries, [&]() {
+        return [&, radiusMatches = std::vector<nanoflann::ResultItem<size_t, float> >()](const size_t i, std::vector<uint32_t> &out) mutable {
+            const size_t idx = subset != nullptr ? (*subset)[i] : i;
+            const size_t numMatches = index->radiusSearch(queries.points[idx].data(), radius, radiusMatches);
+            for (size_t j = 0; j < numMatches; j++) out.push_back(static_cast<uint32_t>(radiusMatches[j].first));
+        };
+    });
+}
+
+void NeighborGraph::release() {
+    std::vector<uint64_t>().swap(offsets);
+    std::vector<uint32_t>().swap(ids);
+}
+
+// Graphs are a cache for the machine that computed them and are stored in
+// its byte order
+void NeighborGraph::save(const std::string &filename, const double resolution, const uint64_t targetHash) const {
+    std::ofstream ofs(filename, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("Cannot write " + filename);
+
+    const int32_t version = NEIGHBOR_GRAPH_VERSION;
+    const int32_t s = search;
+    const uint64_t tc = targetCount;
+    const uint64_t qc = count();
+    const uint64_t numIds = ids.size();
+
+    ofs.write(NEIGHBOR_GRAPH_MAGIC, 4);
+    ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    ofs.write(reinterpret_cast<const char *>(&s), sizeof(s));
+    ofs.write(reinterpret_cast<const char *>(&param), sizeof(param));
+    ofs.write(reinterpret_cast<const char *>(&resolution), sizeof(resolution));
+    ofs.write(reinterpret_cast<const char *>(&tc), sizeof(tc));
+    ofs.write(reinterpret_cast<const char *>(&targetHash), sizeof(targetHash));
+    ofs.write(reinterpret_cast<const char *>(&qc), sizeof(qc));
+    ofs.write(reinterpret_cast<const char *>(&numIds), sizeof(numIds));
+    ofs.write(reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    ofs.write(reinterpret_cast<const char *>(ids.data()), ids.size() * sizeof(uint32_t));
+    if (!ofs) throw std::runtime_error("Cannot write " + filename);
+}
+
+bool NeighborGraph::load(const std::string &filename, const NeighborSearch search, const double param, const double resolution, const size_t targetCount, const uint64_t targetHash, const size_t queryCount) {
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs.is_open()) return false;
+
+    char magic[4];
+    int32_t version, s;
+    double p, res;
+    uint64_t tc, th, qc, numIds;
+
+    ifs.read(magic, 4);
+    ifs.read(reinterpret_cast<char *>(&version), sizeof(version));
+    ifs.read(reinterpret_cast<char *>(&s), sizeof(s));
+    ifs.read(reinterpret_cast<char *>(&p), sizeof(p));
+    ifs.read(reinterpret_cast<char *>(&res), sizeof(res));
+    ifs.read(reinterpret_cast<char *>(&tc), sizeof(tc));
+    ifs.read(reinterpret_cast<char *>(&th), sizeof(th));
+    ifs.read(reinterpret_cast<char *>(&qc), sizeof(qc));
+    ifs.read(reinterpret_cast<char *>(&numIds), sizeof(numIds));
+
+    if (!ifs || std::memcmp(magic, NEIGHBOR_GRAPH_MAGIC, 4) != 0 || version != NEIGHBOR_GRAPH_VERSION ||
+        s != search || p != param || res != resolution || tc != targetCount || th != targetHash || qc != queryCount) return false;
+
+    offsets.resize(qc + 1);
+    ids.resize(numIds);
+    ifs.read(reinterpret_cast<char *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    ifs.read(reinterpret_cast<char *>(ids.data()), ids.size() * sizeof(uint32_t));
+    if (!ifs || offsets[qc] != numIds) {
+        release();
+        return false;
+    }
+
+    this->search = search;
+    this->param = param;
+    this->targetCount = targetCount;
+    return true;
+}
+
+uint64_t NeighborGraph::hashPoints(const PointSet &pSet) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const auto &p : pSet.points) {
+        for (const float v : p) {
+            uint32_t w;
+            std::memcpy(&w, &v, sizeof(w));
+            hash = (hash ^ w) * 1099511628211ULL;
+        }
+    }
+
+    return hash;
+}
@@ -0,0 +1,67 @@
+#ifndef NEIGHBORGRAPH_H
+#define NEIGHBORGRAPH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "point_io.hpp"
+#include "voxelgrid.hpp"
+
+#define NEIGHBOR_GRAPH_MAGIC "OPCN"
+#define NEIGHBOR_GRAPH_VERSION 2
+
+// Coarse-to-fine kNN searches this many times k neighbors per voxel
+#define KNN_HIERARCHY_CANDIDATES 3
+
+enum NeighborSearch { KnnSearch, RadiusSearch };
+
+// Neighbors of a list of query points, found once and shared by every pass
+// that needs them. CSR layout: query i owns ids[offsets[i]] ...
+// ids[offsets[i + 1] - 1], in the order returned by the kd-tree (nearest
+// first). Ids index the target point set and are 32 bit to halve the size.
+struct NeighborGraph {
+    NeighborSearch search = KnnSearch;
+    double param = 0; // k or radius (squared, as passed to nanoflann)
+    size_t targetCount = 0;
+
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> ids;
+
+    inline bool empty() const { return offsets.empty(); }
+    inline size_t count() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    inline size_t size(size_t i) const { return offsets[i + 1] - offsets[i]; }
+    inline const uint32_t *neighbors(size_t i) const { return ids.data() + offsets[i]; }
+
+    // k nearest neighbors in target of each query point (all of them, or
+    // the given subset). Queries with fewer than k results are padded with
+    // their farthest neighbor, so that every query has exactly k.
+    void knn(const PointSet &queries, PointSet &target, int k, const std::vector<size_t> *subset = nullptr);
+
+    // Same as knn (for all queries), when target was decimated from queries
+    // with grid (target point v represents voxel v). The neighbors of each
+    // voxel's point are searched once, KNN_HIERARCHY_CANDIDATES * k of them:
+    // a query at distance d from it, whose k-th nearest candidate is at dk,
+    // has all its k nearest neighbors among them if d + dk is less than the
+    // distance to the farthest candidate. Other queries (or ties, whose
+    // order the kd-tree decides) fall back to a normal search.
+    void knn(const PointSet &queries, PointSet &target, int k, const VoxelGrid &grid);
+
+    // Neighbors in target within radius of each query point
+    void radius(const PointSet &queries, PointSet &target, float radius, const std::vector<size_t> *subset = nullptr);
+
+    void release();
+
+    // Save the graph with the resolution and hashPoints() of its target, so
+    // that a later load can tell whether the target is still the same
+    void save(const std::string &filename, double resolution, uint64_t targetHash) const;
+
+    // Load a graph saved with the same search, parameter, target resolution,
+    // size and hash, and number of queries. Returns false if there is none.
+    bool load(const std::string &filename, NeighborSearch search, double param, double resolution, size_t targetCount, uint64_t targetHash, size_t queryCount);
+
+    // Cheap hash (FNV-1a over 32 bit words) of the coordinates of a point set
+    static uint64_t hashPoints(const PointSet &pSet);
+};
+
+#endif
@@ -22,6 +22,9 @@ int main(int argc, char **argv) {
         ("s,skip", "Do not apply these classification labels (comma separated) and leave them as-is", cxxopts::value<std::vector<int>>())
         ("e,eval", "If the input point cloud is labeled, enable accuracy evaluation", cxxopts::value<bool>()->default_value("false"))
         ("stats-file", "Write evaluation statistics to json file", cxxopts::value<std::string>()->default_value(""))
+        ("neighbors-cache", "Save the neighbor searches of each scale to files starting with this path, and reuse them in later runs on the same input", cxxopts::value<std::string>()->default_value(""))
+        ("inference", "Random forest inference engine (flat, quickscorer). quickscorer only supports trees of at most 64 leaves (max depth 6)", cxxopts::value<std::string>()->default_value("flat"))
+        ("morton-order", "Order the points of each scale along a Z-order curve instead of row by row (the output keeps the input order)", cxxopts::value<bool>()->default_value("false"))
         ("h,help", "Print usage")
         ;
     options.parse_positional({ "input", "output", "model" });
@@ -41,9 +44,11 @@ int main(int argc, char **argv) {
     if (result.count("help") || !result.count("input") || !result.count("output")) showHelp = true;
 
     Regularization regularization = Regularization::None;
+    rf::Inference inference = rf::FlatInference;
 
     try {
         regularization = parseRegularization(result["regularization"].as<std::string>());
+        inference = rf::parseInference(result["inference"].as<std::string>());
     }
     catch (...) { showHelp = true; }
 
@@ -65,8 +70,8 @@ int main(int argc, char **argv) {
         if (ctype == GradientBoostedTrees) throw std::runtime_error(modelFile + " is a GBT model but GBT support has not been built (try building with -DWITH_GBT=ON)");
         #endif
 
-        std::cout << "Model: " << (ctype == RandomForest ? "Random Forest" : "Gradient Boosted Trees") << std::endl;
-        rf::RandomForest *rtrees;
+        std::cout << "Model: " << (ctype != GradientBoostedTrees ? "Random Forest" : "Gradient Boosted Trees") << std::endl;
+        rf::FlatForest *forest;
         #ifdef WITH_GBT
         gbm::Boosting *booster;
         #endif
@@ -75,11 +80,13 @@ int main(int argc, char **argv) {
         double radius;
         int numScales;
 
-        if (ctype == RandomForest) {
-            rtrees = rf::loadForest(modelFile);
-            startResolution = rtrees->params.resolution;
-            radius = rtrees->params.radius;
-            numScales = rtrees->params.numScales;
+        if (ctype != GradientBoostedTrees) {
+            forest = rf::loadFlatForest(modelFile);
+            if (inference == rf::QuickScorerInference && !rf::QuickScorer::supports(*forest))
+                throw std::runtime_error("--inference quickscorer only supports trees of at most 64 leaves (max depth 6)");
+            startResolution = forest->params.resolution;
+            radius = forest->params.radius;
+            numScales = forest->params.numScales;
         }
         #ifdef WITH_GBT
         else {
@@ -96,8 +103,9 @@ int main(int argc, char **argv) {
 
         std::cout << "Starting resolution: " << startResolution << std::endl;
 
-        const auto features = getFeatures(computeScales(numScales, pointSet, startResolution, radius));
-        std::cout << "Features: " << features.size() << std::endl;
+        const auto neighborsCache = result["neighbors-cache"].as<std::string>();
+        const FeatureMatrix features(computeScales(numScales, pointSet, startResolution, radius, neighborsCache, result["morton-order"].as<bool>()));
+        std::cout << "Features: " << features.cols() << std::endl;
 
         const auto eval = result["eval"].as<bool>();
         const auto statsFile = result["stats-file"].as<std::string>();
@@ -105,9 +113,9 @@ int main(int argc, char **argv) {
         const auto color = result["color"].as<bool>();
         const auto unclassified = result["unclassified"].as<bool>();
 
-        if (ctype == RandomForest) {
-            rf::classify(*pointSet, rtrees, features, labels, regularization,
-                regRadius, color, unclassified, eval, skip, statsFile);
+        if (ctype != GradientBoostedTrees) {
+            rf::classify(*pointSet, *forest, features, labels, regularization,
+                regRadius, color, unclassified, eval, skip, statsFile, inference);
         }
         #ifdef WITH_GBT
         else {
@@ -26,6 +26,10 @@ int main(int argc, char **argv) {
         ("stats", "Path where to store evaluation statistics (JSON)", cxxopts::value<std::string>()->default_value(""))
         ("c,classifier", "Which classifier type to use (rf = Random Forest, gbt = Gradient Boosted Trees)", cxxopts::value<std::string>()->default_value("rf"))
         ("classes", "Train only these classification classes (comma separated IDs)", cxxopts::value<std::vector<int>>())
+        ("split", "Random forest split finder (exact, histogram)", cxxopts::value<std::string>()->default_value("exact"))
+        ("sample-memory", "Maximum memory for training samples (MB); beyond it, samples are stored in a temporary file (0 = no limit)", cxxopts::value<int>()->default_value("0"))
+        ("leaf-bits", "Store random forest leaf probabilities with this many bits (32 = float, 16 or 8 = fixed point, smaller model)", cxxopts::value<int>()->default_value("32"))
+        ("convert", "Convert this random forest model to the current model format, save it to --output and exit", cxxopts::value<std::string>()->default_value(""))
         ("h,help", "Print usage")
         ;
     options.parse_positional({ "input" });
@@ -40,12 +44,25 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    if (result.count("help") || !result.count("input")) {
+    const auto convertFilename = result["convert"].as<std::string>();
+    const auto leafBits = result["leaf-bits"].as<int>();
+
+    if (result.count("help") || (!result.count("input") && convertFilename.empty())) {
         std::cout << options.help() << std::endl;
         return EXIT_SUCCESS;
     }
 
     try {
+        if (!convertFilename.empty()) {
+            if (fingerprint(convertFilename) == GradientBoostedTrees) throw std::runtime_error(convertFilename + " is not a random forest model");
+
+            rf::FlatForest *forest = rf::loadFlatForest(convertFilename);
+            if (leafBits != 32) forest->quantize(leafBits);
+            rf::saveFlatForest(*forest, result["output"].as<std::string>());
+            delete forest;
+            return EXIT_SUCCESS;
+        }
+
         const auto filenames = result["input"].as<std::vector<std::string>>();
         const auto modelFilename = result["output"].as<std::string>();
 
@@ -62,6 +79,8 @@ int main(int argc, char **argv) {
 
         std::vector<int> classes = {};
         if (result.count("classes")) classes = result["classes"].as<std::vector<int>>();
+        const rf::SplitFinder splitFinder = rf::parseSplitFinder(result["split"].as<std::string>());
+        const size_t sampleMemory = static_cast<size_t>(std::max(0, result["sample-memory"].as<int>())) << 20;
 
         if (classifier != "rf" && classifier != "gbt") {
             std::cout << options.help() << std::endl;
@@ -78,14 +97,16 @@ int main(int argc, char **argv) {
         std::cout << "Using " << (classifier == "rf" ? "Random Forest" : "Gradient Boosted Trees") << std::endl;
 
         if (classifier == "rf") {
-            rf::RandomForest *rtrees = rf::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes);
-            rf::saveForest(rtrees, modelFilename);
+            rf::RandomForest *rtrees = rf::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes, splitFinder, sampleMemory);
+            rf::FlatForest forest(*rtrees);
             delete rtrees;
+            if (leafBits != 32) forest.quantize(leafBits);
+            rf::saveFlatForest(forest, modelFilename);
         }
 
         #ifdef WITH_GBT
         else if (classifier == "gbt") {
-            gbm::Boosting *booster = gbm::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes);
+            gbm::Boosting *booster = gbm::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes, sampleMemory);
             gbm::saveBooster(booster, modelFilename);
         }
         #endif
@@ -96,13 +117,13 @@ int main(int argc, char **argv) {
 
             const ClassifierType ctype = fingerprint(modelFilename);
 
-            rf::RandomForest *rtrees = nullptr;
+            rf::FlatForest *forest = nullptr;
             #ifdef WITH_GBT
             gbm::Boosting *booster = nullptr;
             #endif
 
-            if (ctype == RandomForest) {
-                rtrees = rf::loadForest(modelFilename);
+            if (ctype != GradientBoostedTrees) {
+                forest = rf::loadFlatForest(modelFilename);
             }
 
             #ifdef WITH_GBT
@@ -115,11 +136,11 @@ int main(int argc, char **argv) {
             const auto evalPointSet = readPointSet(evalFilename);
 
             if (!evalPointSet->hasLabels()) throw std::runtime_error("Evaluation dataset has no labels");
-            const auto evalFeatures = getFeatures(computeScales(scales, evalPointSet, startResolution, radius));
-            std::cout << "Features: " << evalFeatures.size() << std::endl;
+            const FeatureMatrix evalFeatures(computeScales(scales, evalPointSet, startResolution, radius));
+            std::cout << "Features: " << evalFeatures.cols() << std::endl;
 
-            if (ctype == RandomForest) {
-                rf::classify(*evalPointSet, rtrees, evalFeatures, labels, Regularization::None, 2.5, 
+            if (ctype != GradientBoostedTrees) {
+                rf::classify(*evalPointSet, *forest, evalFeatures, labels, Regularization::None, 2.5, 
                     true, false, true, {}, statsFile);
             }
 
@@ -1,5 +1,14 @@
 #include <random>
 #include <filesystem>
+#include <cstring>
+#include <charconv>
+#include <omp.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "point_io.hpp"
 #include "labels.hpp"
@@ -70,39 +79,184 @@ double PointSet::spacing(int kNeighbors) {
     return m_spacing;
 }
 
-std::string getVertexLine(std::ifstream &reader) {
-    std::string line;
+KdTree::KdTree(const int dimensionality, const PointSet &pSet, const nanoflann::KDTreeSingleIndexAdaptorParams &params) :
+    Adaptor(dimensionality, pSet, { params.leaf_max_size, nanoflann::KDTreeSingleIndexAdaptorFlags::SkipInitialBuildIndex }) {
+    if (!(params.flags & nanoflann::KDTreeSingleIndexAdaptorFlags::SkipInitialBuildIndex)) buildIndex();
+}
+
+void KdTree::buildIndex() {
+    const size_t np = dataset_.kdtree_get_point_count();
+    freeIndex(*this);
+    pools.reset(new nanoflann::PooledAllocator[omp_get_max_threads()]);
+    size_ = size_at_index_build_ = np;
+    vAcc_.resize(np);
+    if (np == 0) return;
+
+    float minX = std::numeric_limits<float>::max(), minY = minX, minZ = minX;
+    float maxX = std::numeric_limits<float>::lowest(), maxY = maxX, maxZ = maxX;
+
+    #pragma omp parallel for reduction(min: minX, minY, minZ) reduction(max: maxX, maxY, maxZ)
+    for (long long int i = 0; i < np; i++) {
+        vAcc_[i] = i;
+        const auto &p = dataset_.points[i];
+        minX = std::min(minX, p[0]);
+        minY = std::min(minY, p[1]);
+        minZ = std::min(minZ, p[2]);
+        maxX = std::max(maxX, p[0]);
+        maxY = std::max(maxY, p[1]);
+        maxZ = std::max(maxZ, p[2]);
+    }
+
+    root_bbox_[0] = { minX, maxX };
+    root_bbox_[1] = { minY, maxY };
+    root_bbox_[2] = { minZ, maxZ };
 
-    // Skip comments
-    do {
-        std::getline(reader, line);
-
-        if (line.find("element") == 0)
-            return line;
-        else if (line.find("comment") == 0)
-            continue;
-        else
-            throw std::runtime_error("Invalid PLY file");
-    } while (true);
+    #pragma omp parallel
+    #pragma omp single
+    root_node_ = divideTree(0, np, root_bbox_);
 }
 
-size_t getVertexCount(const std::string &line) {
+// Same as nanoflann's KDTreeBaseClass::divideTree
+KdTree::NodePtr KdTree::divideTree(const Offset left, const Offset right, BoundingBox &bbox) {
+    NodePtr node = pools[omp_get_thread_num()].allocate<Node>();
+
+    if (right - left <= static_cast<Offset>(leaf_max_size_)) {
+        node->child1 = node->child2 = nullptr;
+        node->node_type.lr.left = left;
+        node->node_type.lr.right = right;
+
+        for (Dimension i = 0; i < 3; i++) {
+            bbox[i].low = bbox[i].high = dataset_get(*this, vAcc_[left], i);
+        }
+        for (Offset k = left + 1; k < right; k++) {
+            for (Dimension i = 0; i < 3; i++) {
+                const float val = dataset_get(*this, vAcc_[k], i);
+                if (bbox[i].low > val) bbox[i].low = val;
+                if (bbox[i].high < val) bbox[i].high = val;
+            }
+        }
+        return node;
+    }
 
-    // Split line into tokens
-    std::vector<std::string> tokens;
+    Offset idx;
+    Dimension cutfeat;
+    DistanceType cutval;
+    middleSplit_(*this, left, right - left, idx, cutfeat, cutval, bbox);
+    node->node_type.sub.divfeat = cutfeat;
+
+    BoundingBox leftBbox(bbox);
+    leftBbox[cutfeat].high = cutval;
+    BoundingBox rightBbox(bbox);
+    rightBbox[cutfeat].low = cutval;
+
+    if (right - left > KDTREE_TASK_MIN_POINTS) {
+        #pragma omp task shared(leftBbox)
+        node->child1 = divideTree(left, left + idx, leftBbox);
+        node->child2 = divideTree(left + idx, right, rightBbox);
+        #pragma omp taskwait
+    }
+    else {
+        node->child1 = divideTree(left, left + idx, leftBbox);
+        node->child2 = divideTree(left + idx, right, rightBbox);
+    }
 
-    std::istringstream iss(line);
-    std::string token;
-    while (std::getline(iss, token, ' '))
-        tokens.push_back(token);
+    node->node_type.sub.divlow = leftBbox[cutfeat].high;
+    node->node_type.sub.divhigh = rightBbox[cutfeat].low;
 
-    if (tokens.size() < 3)
-        throw std::runtime_error("Invalid PLY file");
+    for (Dimension i = 0; i < 3; i++) {
+        bbox[i].low = std::min(leftBbox[i].low, rightBbox[i].low);
+        bbox[i].high = std::max(leftBbox[i].high, rightBbox[i].high);
+    }
 
-    if (tokens[0] != "element" && tokens[1] != "vertex")
-        throw std::runtime_error("Invalid PLY file");
+    return node;
+}
 
-    return std::stoi(tokens[2]);
+static PlyType parsePlyType(const std::string &type) {
+    if (type == "char" || type == "int8") return PlyInt8;
+    if (type == "uchar" || type == "uint8") return PlyUInt8;
+    if (type == "short" || type == "int16") return PlyInt16;
+    if (type == "ushort" || type == "uint16") return PlyUInt16;
+    if (type == "int" || type == "int32") return PlyInt32;
+    if (type == "uint" || type == "uint32") return PlyUInt32;
+    if (type == "float" || type == "float32") return PlyFloat32;
+    if (type == "double" || type == "float64") return PlyFloat64;
+    throw std::runtime_error("Invalid PLY file (unknown property type '" + type + "')");
+}
+
+static size_t plyTypeSize(const PlyType type) {
+    switch (type) {
+    case PlyInt8: case PlyUInt8: return 1;
+    case PlyInt16: case PlyUInt16: return 2;
+    case PlyInt32: case PlyUInt32: case PlyFloat32: return 4;
+    case PlyFloat64: return 8;
+    }
+    return 0;
+}
+
+PlyHeader readPlyHeader(std::ifstream &reader) {
+    PlyHeader h;
+    std::string line;
+
+    const auto nextLine = [&reader, &line]() {
+        if (!std::getline(reader, line)) throw std::runtime_error("Invalid PLY file (unexpected end of header)");
+        line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+    };
+
+    nextLine();
+    if (line != "ply")
+        throw std::runtime_error("Invalid PLY file (header does not start with ply)");
+
+    nextLine();
+    if (line == "format ascii 1.0") h.format = PlyAscii;
+    else if (line == "format binary_little_endian 1.0") h.format = PlyBinaryLittleEndian;
+    else if (line == "format binary_big_endian 1.0") h.format = PlyBinaryBigEndian;
+    else throw std::runtime_error("Invalid PLY file (unsupported format '" + line + "')");
+
+    bool seenVertex = false;
+    bool inVertex = false;
+
+    while (true) {
+        nextLine();
+        if (line == "end_header") break;
+
+        std::istringstream iss(line);
+        std::string keyword;
+        iss >> keyword;
+
+        if (keyword == "comment" || keyword == "obj_info" || keyword.empty()) continue;
+        else if (keyword == "element") {
+            std::string name;
+            size_t count;
+            if (!(iss >> name >> count)) throw std::runtime_error("Invalid PLY file (bad element '" + line + "')");
+
+            inVertex = name == "vertex";
+            if (inVertex) {
+                seenVertex = true;
+                h.vertexCount = count;
+            }
+            else if (!seenVertex) throw std::runtime_error("Invalid PLY file (vertex element must come first)");
+        }
+        else if (keyword == "property") {
+            std::string type, name;
+            if (!(iss >> type >> name)) throw std::runtime_error("Invalid PLY file (bad property '" + line + "')");
+            if (!inVertex) continue;
+            if (type == "list") throw std::runtime_error("Invalid PLY file (list properties are not supported for vertices)");
+
+            PlyProperty prop;
+            prop.name = name;
+            prop.type = parsePlyType(type);
+            prop.size = plyTypeSize(prop.type);
+            prop.offset = h.stride;
+            h.stride += prop.size;
+            h.properties.push_back(prop);
+        }
+        else throw std::runtime_error("Invalid PLY file (unexpected '" + line + "')");
+    }
+
+    if (!seenVertex) throw std::runtime_error("Invalid PLY file (no vertex element)");
+    h.length = static_cast<size_t>(reader.tellg());
+
+    return h;
 }
 
 PointSet *readPointSet(const std::string &filename) {
@@ -143,177 +297,322 @@ PointSet *readPointSet(const std::string &filename) {
     return r;
 }
 
-PointSet *fastPlyReadPointSet(const std::string &filename) {
-    std::ifstream reader(filename, std::ios::binary);
-    if (!reader.is_open())
-        throw std::runtime_error("Cannot open file " + filename);
-
-    auto *r = new PointSet();
+size_t readPointCount(const std::string &filename) {
+    const fs::path p(filename);
+    std::string ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
 
-    std::string line;
-    std::getline(reader, line);
-    line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+    std::ifstream reader(filename, std::ios::binary);
+    if (!reader.is_open()) return 0;
 
-    if (line != "ply")
-        throw std::runtime_error("Invalid PLY file (header does not start with ply)");
+    if (ext == ".ply") {
+        try {
+            return readPlyHeader(reader).vertexCount;
+        }
+        catch (const std::runtime_error &) {
+            return 0;
+        }
+    }
 
-    std::getline(reader, line);
-    line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+    if (ext == ".las" || ext == ".laz") {
+        // Public header block: the legacy (32 bit) point count at offset 107,
+        // and since LAS 1.4 the 64 bit count at offset 247. Little-endian.
+        unsigned char h[255];
+        if (!reader.read(reinterpret_cast<char *>(h), sizeof(h)) || std::memcmp(h, "LASF", 4) != 0) return 0;
+
+        auto le = [&h](const size_t offset, const size_t bytes) {
+            uint64_t v = 0;
+            for (size_t i = 0; i < bytes; i++) v |= static_cast<uint64_t>(h[offset + i]) << (8 * i);
+            return v;
+        };
+        const uint64_t legacyCount = le(107, 4);
+        if (legacyCount > 0 || h[24] != 1 || h[25] < 4) return static_cast<size_t>(legacyCount);
+        return static_cast<size_t>(le(247, 8));
+    }
 
-    // We are reading an ascii ply
-    bool ascii = line == "format ascii 1.0";
+    return 0;
+}
 
-    const auto vertexLine = getVertexLine(reader);
-    const auto count = getVertexCount(vertexLine);
+enum PlyTarget { PlySkip, PlyX, PlyY, PlyZ, PlyNX, PlyNY, PlyNZ, PlyRed, PlyGreen, PlyBlue, PlyViews, PlyLabel, PLY_TARGETS };
 
-    std::cout << "Reading " << count << " points" << std::endl;
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.length() >= suffix.length() && s.compare(s.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
 
-    checkHeader(reader, "x");
-    checkHeader(reader, "y");
-    checkHeader(reader, "z");
+static PlyTarget plyTarget(const std::string &name) {
+    if (name == "x") return PlyX;
+    if (name == "y") return PlyY;
+    if (name == "z") return PlyZ;
+    if (endsWith(name, "nx") || endsWith(name, "normal_x") || endsWith(name, "normalx")) return PlyNX;
+    if (endsWith(name, "ny") || endsWith(name, "normal_y") || endsWith(name, "normaly")) return PlyNY;
+    if (endsWith(name, "nz") || endsWith(name, "normal_z") || endsWith(name, "normalz")) return PlyNZ;
+    if (endsWith(name, "red")) return PlyRed;
+    if (endsWith(name, "green")) return PlyGreen;
+    if (endsWith(name, "blue")) return PlyBlue;
+    if (endsWith(name, "views")) return PlyViews;
+    if (endsWith(name, "label") || endsWith(name, "classification") || endsWith(name, "class")) return PlyLabel;
+    return PlySkip;
+}
 
-    int c = 0;
-    bool hasViews = false;
-    bool hasNormals = false;
-    bool hasColors = false;
-    std::string labelDim;
+// Map each vertex property to the PointSet field it fills. Only the first
+// property for each field is used, the others (and unknown ones) are skipped.
+static std::vector<PlyTarget> plyTargets(const PlyHeader &h) {
+    std::vector<PlyTarget> targets;
+    std::array<bool, PLY_TARGETS> seen;
+    seen.fill(false);
+
+    for (const auto &prop : h.properties) {
+        PlyTarget t = plyTarget(prop.name);
+        if (seen[t]) t = PlySkip;
+        seen[t] = true;
+        targets.push_back(t);
+    }
 
-    size_t redIdx = 0, greenIdx = 1, blueIdx = 2;
+    if (!seen[PlyX] || !seen[PlyY] || !seen[PlyZ]) throw std::runtime_error("Invalid PLY file (missing x/y/z properties)");
+    return targets;
+}
 
-    std::getline(reader, line);
-    line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+template <typename T>
+static inline T plyLoad(const char *p, const bool swap) {
+    T v;
+    if (swap) {
+        char buf[sizeof(T)];
+        std::reverse_copy(p, p + sizeof(T), buf);
+        std::memcpy(&v, buf, sizeof(T));
+    }
+    else std::memcpy(&v, p, sizeof(T));
+    return v;
+}
 
-    while (line != "end_header") {
-        if (hasHeader(line, "nx") || hasHeader(line, "normal_x") || hasHeader(line, "normalx")) hasNormals = true;
-        if (hasHeader(line, "red")) {
-            hasColors = true;
-            redIdx = c;
-        }
-        if (hasHeader(line, "green")) {
-            hasColors = true;
-            greenIdx = c;
-        }
-        if (hasHeader(line, "blue")) {
-            hasColors = true;
-            blueIdx = c;
-        }
-        if (hasHeader(line, "views")) hasViews = true;
+static inline double plyValue(const char *p, const PlyType type, const bool swap) {
+    switch (type) {
+    case PlyInt8: return plyLoad<int8_t>(p, swap);
+    case PlyUInt8: return plyLoad<uint8_t>(p, swap);
+    case PlyInt16: return plyLoad<int16_t>(p, swap);
+    case PlyUInt16: return plyLoad<uint16_t>(p, swap);
+    case PlyInt32: return plyLoad<int32_t>(p, swap);
+    case PlyUInt32: return plyLoad<uint32_t>(p, swap);
+    case PlyFloat32: return plyLoad<float>(p, swap);
+    case PlyFloat64: return plyLoad<double>(p, swap);
+    }
+    return 0.0;
+}
 
-        if (hasHeader(line, "label")) labelDim = "label";
-        if (hasHeader(line, "classification")) labelDim = "classification";
-        if (hasHeader(line, "class")) labelDim = "class";
+// Values of 8-bit fields (colors, views, labels) must be in [0, 256), which
+// also rejects NaN: converting anything else to uint8_t is undefined behavior
+static inline bool plyIsByte(const double v) {
+    return v >= 0.0 && v < 256.0;
+}
 
-        if (c++ > 100) break;
-        std::getline(reader, line);
-        line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+// Returns false if the value does not fit the field
+static inline bool plyStore(PointSet *r, const size_t i, const PlyTarget target, const double v) {
+    switch (target) {
+    case PlyX: r->points[i][0] = static_cast<float>(v); break;
+    case PlyY: r->points[i][1] = static_cast<float>(v); break;
+    case PlyZ: r->points[i][2] = static_cast<float>(v); break;
+    case PlyNX: r->normals[i][0] = static_cast<float>(v); break;
+    case PlyNY: r->normals[i][1] = static_cast<float>(v); break;
+    case PlyNZ: r->normals[i][2] = static_cast<float>(v); break;
+    case PlyRed: if (!plyIsByte(v)) return false; r->colors[i][0] = static_cast<uint8_t>(v); break;
+    case PlyGreen: if (!plyIsByte(v)) return false; r->colors[i][1] = static_cast<uint8_t>(v); break;
+    case PlyBlue: if (!plyIsByte(v)) return false; r->colors[i][2] = static_cast<uint8_t>(v); break;
+    case PlyViews: if (!plyIsByte(v)) return false; r->views[i] = static_cast<uint8_t>(v); break;
+    case PlyLabel: if (!plyIsByte(v)) return false; r->labels[i] = static_cast<uint8_t>(v); break;
+    default: break;
     }
+    return true;
+}
 
-    size_t colorIdxMin = std::min<size_t>(std::min<size_t>(redIdx, greenIdx), blueIdx);
-    redIdx -= colorIdxMin;
-    greenIdx -= colorIdxMin;
-    blueIdx -= colorIdxMin;
-    if (redIdx + greenIdx + blueIdx != 3) throw std::runtime_error("red/green/blue properties need to be contiguous");
+MappedFile::MappedFile(const std::string &filename, const bool sequential) {
+#ifdef _WIN32
+    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    if (!f.is_open()) throw std::runtime_error("Cannot open file " + filename);
+    length = static_cast<size_t>(f.tellg());
+    buffer.resize(length);
+    f.seekg(0);
+    f.read(buffer.data(), length);
+    ptr = buffer.data();
+#else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Cannot open file " + filename);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error("Cannot stat file " + filename);
+    }
+    length = static_cast<size_t>(st.st_size);
 
-    bool hasLabels = !labelDim.empty();
+    if (length > 0) {
+        void *m = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Cannot map file " + filename);
+        }
+        madvise(m, length, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+        ptr = static_cast<const char *>(m);
+    }
+    close(fd);
+#endif
+}
 
-    r->points.resize(count);
-    if (hasNormals) r->normals.resize(count);
-    if (hasColors) r->colors.resize(count);
-    if (hasViews) r->views.resize(count);
-    if (hasLabels) r->labels.resize(count);
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (ptr != nullptr) munmap(const_cast<char *>(ptr), length);
+#endif
+}
 
-    // if (hasNormals) std::cout << "N";
-    // if (hasColors) std::cout << "C";
-    // if (hasViews) std::cout << "V";
-    // if (hasLabels) std::cout << "L";
-    // std::cout << std::endl;
-
-    // Read points
-    if (ascii) {
-        uint16_t buf;
-
-        for (size_t i = 0; i < count; i++) {
-            reader >> r->points[i][0]
-                >> r->points[i][1]
-                >> r->points[i][2];
-            if (hasNormals) {
-                reader >> r->normals[i][0]
-                    >> r->normals[i][1]
-                    >> r->normals[i][2];
-            }
-            if (hasColors) {
-                reader >> buf;
-                r->colors[i][redIdx] = static_cast<uint8_t>(buf);
-                reader >> buf;
-                r->colors[i][greenIdx] = static_cast<uint8_t>(buf);
-                reader >> buf;
-                r->colors[i][blueIdx] = static_cast<uint8_t>(buf);
-            }
-            if (hasViews) {
-                reader >> buf;
-                r->views[i] = static_cast<uint8_t>(buf);
-            }
-            if (hasLabels) {
-                reader >> buf;
-                r->labels[i] = static_cast<uint8_t>(buf);
+static void fastPlyReadBinary(const std::string &filename, const PlyHeader &h, const std::vector<PlyTarget> &targets, PointSet *r) {
+    const MappedFile file(filename);
+    if (file.size() < h.length + h.vertexCount * h.stride)
+        throw std::runtime_error("Invalid PLY file (unexpected end of file)");
+
+    const char *data = file.data() + h.length;
+    const bool swap = h.format == PlyBinaryBigEndian;
+    const size_t numProps = h.properties.size();
+
+    bool outOfRange = false;
+
+    // Fixed-stride records: each thread decodes its own range of vertices
+    #pragma omp parallel for schedule(static)
+    for (long long int i = 0; i < h.vertexCount; i++) {
+        const char *record = data + i * h.stride;
+        for (size_t j = 0; j < numProps; j++) {
+            if (targets[j] == PlySkip) continue;
+            const PlyProperty &prop = h.properties[j];
+            if (!plyStore(r, i, targets[j], plyValue(record + prop.offset, prop.type, swap))) {
+                #pragma omp atomic write
+                outOfRange = true;
             }
         }
     }
-    else {
 
-        // Read points
-        uint8_t color[3];
+    if (outOfRange) throw std::runtime_error("Invalid PLY file (color, views or label value outside of 0-255)");
+}
 
-        for (size_t i = 0; i < count; i++) {
-            reader.read(reinterpret_cast<char *>(r->points[i].data()), sizeof(float) * 3);
+static inline bool plyIsSpace(const char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-            if (hasNormals) {
-                reader.read(reinterpret_cast<char *>(r->normals[i].data()), sizeof(float) * 3);
-            }
+// Next non-blank line in [p, end). Returns false when no more lines are left.
+static inline bool plyNextLine(const char *&p, const char *end, const char *&lineStart, const char *&lineEnd) {
+    while (p < end) {
+        const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (eol == nullptr) eol = end;
 
-            if (hasColors) {
-                reader.read(reinterpret_cast<char *>(&color), sizeof(uint8_t) * 3);
-                r->colors[i][redIdx] = color[0];
-                r->colors[i][greenIdx] = color[1];
-                r->colors[i][blueIdx] = color[2];
-            }
+        lineStart = p;
+        lineEnd = eol;
+        p = eol < end ? eol + 1 : end;
 
-            if (hasViews) {
-                reader.read(reinterpret_cast<char *>(&r->views[i]), sizeof(uint8_t));
-            }
+        while (lineStart < lineEnd && plyIsSpace(*lineStart)) lineStart++;
+        if (lineStart < lineEnd) return true;
+    }
+    return false;
+}
+
+static void fastPlyReadAscii(const std::string &filename, const PlyHeader &h, const std::vector<PlyTarget> &targets, PointSet *r) {
+    const MappedFile file(filename);
+    const char *body = file.data() + std::min(h.length, file.size());
+    const char *end = file.data() + file.size();
+    const size_t numProps = targets.size();
+
+    // Split the body into line-aligned chunks, one per thread
+    const size_t numChunks = std::max<size_t>(1, std::min<size_t>(omp_get_max_threads(), (end - body) / PLY_ASCII_MIN_CHUNK));
+    std::vector<const char *> bounds(numChunks + 1);
+    bounds[0] = body;
+    bounds[numChunks] = end;
+    for (size_t c = 1; c < numChunks; c++) {
+        const char *p = std::max(bounds[c - 1], body + (end - body) * c / numChunks);
+        const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        bounds[c] = eol == nullptr ? end : eol + 1;
+    }
 
-            if (hasLabels) {
-                reader.read(reinterpret_cast<char *>(&r->labels[i]), sizeof(uint8_t));
+    // Count the lines of each chunk to find the index of its first vertex
+    std::vector<size_t> firstVertex(numChunks + 1, 0);
+    #pragma omp parallel for schedule(static, 1)
+    for (long long int c = 0; c < static_cast<long long int>(numChunks); c++) {
+        const char *p = bounds[c];
+        const char *lineStart, *lineEnd;
+        size_t lines = 0;
+        while (plyNextLine(p, bounds[c + 1], lineStart, lineEnd)) lines++;
+        firstVertex[c + 1] = lines;
+    }
+    for (size_t c = 0; c < numChunks; c++) firstVertex[c + 1] += firstVertex[c];
+
+    if (firstVertex[numChunks] < h.vertexCount)
+        throw std::runtime_error("Invalid PLY file (unexpected end of file)");
+
+    bool failed = false;
+    bool outOfRange = false;
+
+    #pragma omp parallel for schedule(static, 1)
+    for (long long int c = 0; c < static_cast<long long int>(numChunks); c++) {
+        const char *p = bounds[c];
+        const char *lineStart, *lineEnd;
+
+        // Lines past the vertex element belong to other elements and are ignored
+        for (size_t i = firstVertex[c]; i < h.vertexCount && plyNextLine(p, bounds[c + 1], lineStart, lineEnd); i++) {
+            const char *s = lineStart;
+            for (size_t j = 0; j < numProps; j++) {
+                while (s < lineEnd && plyIsSpace(*s)) s++;
+                if (s < lineEnd && *s == '+') s++;
+
+                double v;
+                const auto res = std::from_chars(s, lineEnd, v);
+                if (res.ec != std::errc() || (res.ptr < lineEnd && !plyIsSpace(*res.ptr))) {
+                    #pragma omp atomic write
+                    failed = true;
+                    break;
+                }
+                s = res.ptr;
+
+                if (targets[j] != PlySkip && !plyStore(r, i, targets[j], v)) {
+                    #pragma omp atomic write
+                    outOfRange = true;
+                }
             }
         }
     }
 
-    // std::vector<size_t> classes(255, 0);
-    // for (size_t idx = 0; idx < count; idx++) {
-    //     std::cout << r->points[idx][0] << " ";
-    //     std::cout << r->points[idx][1] << " ";
-    //     std::cout << r->points[idx][2] << " ";
+    if (failed) throw std::runtime_error("Invalid PLY file (cannot parse vertex data)");
+    if (outOfRange) throw std::runtime_error("Invalid PLY file (color, views or label value outside of 0-255)");
+}
 
-    //     std::cout << std::to_string(r->colors[idx][0]) << " ";
-    //     std::cout << std::to_string(r->colors[idx][1]) << " ";
-    //     std::cout << std::to_string(r->colors[idx][2]) << " ";
+PointSet *fastPlyReadPointSet(const std::string &filename) {
+    std::ifstream reader(filename, std::ios::binary);
+    if (!reader.is_open())
+        throw std::runtime_error("Cannot open file " + filename);
 
-    //     if (hasLabels){
-    //         std::cout << std::to_string(r->labels[idx]) << " ";
-    //     }
-    //     std::cout << std::endl;
+    const PlyHeader header = readPlyHeader(reader);
+    const auto targets = plyTargets(header);
+    const size_t count = header.vertexCount;
 
-    //     if (idx > 9) exit(1);
-    //     classes[std::size_t(r->labels[idx])]++;
-    // }
+    std::cout << "Reading " << count << " points" << std::endl;
 
-    // for (size_t i = 0; i < classes.size(); i++){
-    //     std::cout << i << ": " << classes[i] << std::endl;
-    // }
-    // exit(1);
+    bool hasNormals = false;
+    bool hasColors = false;
+    bool hasViews = false;
+    bool hasLabels = false;
+
+    for (const auto t : targets) {
+        if (t == PlyNX || t == PlyNY || t == PlyNZ) hasNormals = true;
+        if (t == PlyRed || t == PlyGreen || t == PlyBlue) hasColors = true;
+        if (t == PlyViews) hasViews = true;
+        if (t == PlyLabel) hasLabels = true;
+    }
+
+    auto *r = new PointSet();
+    r->points.resize(count);
+    if (hasNormals) r->normals.resize(count);
+    if (hasColors) r->colors.resize(count);
+    if (hasViews) r->views.resize(count);
+    if (hasLabels) r->labels.resize(count);
 
     reader.close();
 
+    if (header.format == PlyAscii) fastPlyReadAscii(filename, header, targets, r);
+    else fastPlyReadBinary(filename, header, targets, r);
+
     return r;
 }
 
@@ -439,28 +738,7 @@ PointSet *pdalReadPointSet(const std::string &filename) {
     #endif
 }
 
-void checkHeader(std::ifstream &reader, const std::string &prop) {
-    std::string line;
-    std::getline(reader, line);
-    line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-
-    if (line.substr(line.length() - prop.length(), prop.length()) != prop) {
-        throw std::runtime_error("Invalid PLY file (expected 'property * " + prop + "', but found '" + line + "')");
-    }
-}
-
-bool hasHeader(const std::string &line, const std::string &prop) {
-    //std::cout << line << " -> " << prop << " : " << line.substr(line.length() - prop.length(), prop.length()) << std::endl;
-    return line.substr(0, 8) == "property" && line.substr(line.length() - prop.length(), prop.length()) == prop;
-}
-
 void savePointSet(PointSet &pSet, const std::string &filename) {
-    
-    std::cout<< "savePointSet" << std::endl;
-    for (size_t idx = 0; idx < pSet.count(); idx++) {
-        int label = pSet.labels[idx];
-    }
-
     const fs::path p(filename);
     if (p.extension().string() == ".ply") fastPlySavePointSet(pSet, filename);
     else pdalSavePointSet(pSet, filename);
@@ -552,14 +830,50 @@ void fastPlySavePointSet(PointSet &pSet, const std::string &filename) {
 
     o << "end_header" << std::endl;
 
-    for (size_t i = 0; i < pSet.count(); i++) {
-        o.write(reinterpret_cast<const char *>(pSet.points[i].data()), sizeof(float) * 3);
-        if (hasNormals) o.write(reinterpret_cast<const char *>(pSet.normals[i].data()), sizeof(float) * 3);
-        if (hasColors) o.write(reinterpret_cast<const char *>(pSet.colors[i].data()), sizeof(uint8_t) * 3);
-        if (hasViews) o.write(reinterpret_cast<const char *>(&pSet.views[i]), sizeof(uint8_t));
-        if (hasLabels) o.write(reinterpret_cast<const char *>(&pSet.labels[i]), sizeof(uint8_t));
+    size_t stride = sizeof(float) * 3;
+    if (hasNormals) stride += sizeof(float) * 3;
+    if (hasColors) stride += sizeof(uint8_t) * 3;
+    if (hasViews) stride += sizeof(uint8_t);
+    if (hasLabels) stride += sizeof(uint8_t);
+
+    // Encode fixed-width records into one buffer per thread in parallel,
+    // then flush the buffers in order with a single write each
+    const size_t count = pSet.count();
+    const int numBuffers = omp_get_max_threads();
+    std::vector<std::vector<char> > buffers(numBuffers, std::vector<char>(PLY_WRITE_BLOCK * stride));
+
+    for (size_t start = 0; start < count; start += PLY_WRITE_BLOCK * numBuffers) {
+        #pragma omp parallel for schedule(static, 1)
+        for (int b = 0; b < numBuffers; b++) {
+            const size_t begin = std::min(count, start + b * PLY_WRITE_BLOCK);
+            const size_t end = std::min(count, begin + PLY_WRITE_BLOCK);
+            char *dst = buffers[b].data();
+
+            for (size_t i = begin; i < end; i++) {
+                std::memcpy(dst, pSet.points[i].data(), sizeof(float) * 3);
+                dst += sizeof(float) * 3;
+                if (hasNormals) {
+                    std::memcpy(dst, pSet.normals[i].data(), sizeof(float) * 3);
+                    dst += sizeof(float) * 3;
+                }
+                if (hasColors) {
+                    std::memcpy(dst, pSet.colors[i].data(), sizeof(uint8_t) * 3);
+                    dst += sizeof(uint8_t) * 3;
+                }
+                if (hasViews) *dst++ = static_cast<char>(pSet.views[i]);
+                if (hasLabels) *dst++ = static_cast<char>(pSet.labels[i]);
+            }
+        }
+
+        for (int b = 0; b < numBuffers; b++) {
+            const size_t begin = std::min(count, start + b * PLY_WRITE_BLOCK);
+            const size_t end = std::min(count, begin + PLY_WRITE_BLOCK);
+            if (end > begin) o.write(buffers[b].data(), (end - begin) * stride);
+        }
     }
 
+    if (!o.good()) throw std::runtime_error("Cannot write " + filename);
+
     o.close();
     std::cout << "Wrote " << filename << std::endl;
 }
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <memory>
 #ifdef WITH_PDAL
 #include <pdal/Options.hpp>
 #include <pdal/PointTable.hpp>
@@ -22,6 +23,10 @@ struct XYZ {
 };
 
 #define KDTREE_MAX_LEAF 10
+// Kd-tree nodes with more points than this are divided in parallel
+#define KDTREE_TASK_MIN_POINTS 65536
+#define PLY_WRITE_BLOCK 65536
+#define PLY_ASCII_MIN_CHUNK (1 << 20)
 
 #define RELEASE_POINTSET(__POINTER) { if (__POINTER != nullptr) { __POINTER->freeIndex<KdTree>(); delete __POINTER; __POINTER = nullptr; } }
 
@@ -64,15 +69,6 @@ struct PointSet {
         return false;
     }
 
-    void appendPoint(PointSet &src, size_t idx) {
-        points.push_back(src.points[idx]);
-        colors.push_back(src.colors[idx]);
-    }
-
-    void trackPoint(PointSet &src, size_t idx) {
-        src.pointMap[idx] = points.size() - 1;
-    }
-
     bool hasNormals() const { return normals.size() > 0; }
     bool hasColors() const { return colors.size() > 0; }
     bool hasViews() const { return views.size() > 0; }
@@ -95,20 +91,72 @@ private:
     double m_spacing = -1.0;
 };
 
-using KdTree = nanoflann::KDTreeSingleIndexAdaptor<
+// nanoflann's kd-tree, with a parallel build: the points are divided exactly
+// as nanoflann does (so searches return the same results), but subtrees of
+// more than KDTREE_TASK_MIN_POINTS points are divided in OpenMP tasks, with
+// nodes allocated from one pool per thread.
+class KdTree : public nanoflann::KDTreeSingleIndexAdaptor<
     nanoflann::L2_Simple_Adaptor<float, PointSet>,
     PointSet, 3, size_t
->;
+> {
+    using Adaptor = nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, PointSet>, PointSet, 3, size_t>;
+
+    std::unique_ptr<nanoflann::PooledAllocator[]> pools;
 
-std::string getVertexLine(std::ifstream &reader);
-size_t getVertexCount(const std::string &line);
-inline void checkHeader(std::ifstream &reader, const std::string &prop);
-inline bool hasHeader(const std::string &line, const std::string &prop);
+    NodePtr divideTree(Offset left, Offset right, BoundingBox &bbox);
+public:
+    KdTree(int dimensionality, const PointSet &pSet, const nanoflann::KDTreeSingleIndexAdaptorParams &params = {});
+
+    void buildIndex();
+};
+
+enum PlyFormat { PlyAscii, PlyBinaryLittleEndian, PlyBinaryBigEndian };
+enum PlyType { PlyInt8, PlyUInt8, PlyInt16, PlyUInt16, PlyInt32, PlyUInt32, PlyFloat32, PlyFloat64 };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    size_t size; // bytes
+    size_t offset; // bytes from the start of a binary vertex record
+};
+
+struct PlyHeader {
+    PlyFormat format;
+    size_t vertexCount = 0;
+    std::vector<PlyProperty> properties;
+    size_t stride = 0; // size of a binary vertex record
+    size_t length = 0; // size of the header (offset of the vertex data)
+};
+
+PlyHeader readPlyHeader(std::ifstream &reader);
+
+// Read-only view of a whole file, memory mapped where available.
+// Set sequential when the file is read once from start to end.
+class MappedFile {
+    const char *ptr = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+public:
+    explicit MappedFile(const std::string &filename, bool sequential = true);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return ptr; }
+    size_t size() const { return length; }
+};
 
 PointSet *fastPlyReadPointSet(const std::string &filename);
 PointSet *pdalReadPointSet(const std::string &filename);
 PointSet *readPointSet(const std::string &filename);
 
+// Number of points of a file, from its header only (PLY, LAS/LAZ).
+// Returns 0 when it cannot be known without reading the points.
+size_t readPointCount(const std::string &filename);
+
 void fastPlySavePointSet(PointSet &pSet, const std::string &filename);
 void pdalSavePointSet(PointSet &pSet, const std::string &filename);
 void savePointSet(PointSet &pSet, const std::string &filename);
@@ -1,7 +1,248 @@
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <functional>
+#include <omp.h>
+
 #include "randomforest.hpp"
 
 namespace rf {
 
+// Features quantized into at most RF_HISTOGRAM_BINS bins of about the same
+// number of samples, stored by feature. The bin of a value is the number of
+// cuts below it, so that value > cut(f, b) exactly when its bin is above b
+// (NaN values, which never go right, end up in bin 0).
+class BinnedFeatures {
+public:
+    explicit BinnedFeatures(const FeatureDataView &samples) : numSamples(samples.rows), cuts(samples.cols), bins(samples.rows * samples.cols) {
+        #pragma omp parallel
+        {
+            std::vector<float> values;
+            values.reserve(numSamples);
+
+            #pragma omp for schedule(dynamic, 1)
+            for (long long int f = 0; f < static_cast<long long int>(samples.cols); f++) {
+                values.clear();
+                for (size_t i = 0; i < numSamples; i++) {
+                    if (!std::isnan(samples(i, f))) values.push_back(samples(i, f));
+                }
+                std::sort(values.begin(), values.end());
+
+                // Cut after every binSize values, between two distinct values
+                std::vector<float> &c = cuts[f];
+                const size_t binSize = std::max<size_t>(1, values.size() / RF_HISTOGRAM_BINS);
+                size_t start = 0;
+                while (c.size() < RF_HISTOGRAM_BINS - 1 && start + binSize < values.size()) {
+                    const size_t end = std::upper_bound(values.begin() + start + binSize - 1, values.end(), values[start + binSize - 1]) - values.begin();
+                    if (end >= values.size()) break;
+
+                    const float mid = static_cast<float>(0.5 * (static_cast<double>(values[end - 1]) + values[end]));
+                    c.push_back(mid < values[end] ? mid : values[end - 1]);
+                    start = end;
+                }
+
+                uint8_t *col = &bins[f * numSamples];
+                for (size_t i = 0; i < numSamples; i++) {
+                    col[i] = std::lower_bound(c.begin(), c.end(), samples(i, f)) - c.begin();
+                }
+            }
+        }
+    }
+
+    const uint8_t *column(const size_t feature) const { return &bins[feature * numSamples]; }
+    float cut(const size_t feature, const size_t bin) const { return cuts[feature][bin]; }
+private:
+    size_t numSamples;
+    std::vector<std::vector<float> > cuts;
+    std::vector<uint8_t> bins;
+};
+
+// Grows a tree like NodeGini::train, except that the best threshold of each
+// proposed feature comes from a class histogram of the binned feature. Large
+// subtrees are built as OpenMP tasks.
+class HistogramTreeBuilder {
+    typedef RandomForest::TreeType::NodeType TreeNode;
+
+    // Per-thread buffers, only used while finding the split of a node
+    struct Scratch {
+        std::vector<uint32_t> hist; // bin-major class counts
+        std::vector<uint64_t> counts;
+        std::vector<uint64_t> classesL;
+        std::vector<uint64_t> classesR;
+    };
+public:
+    HistogramTreeBuilder(const BinnedFeatures &binned, const FeatureDataView &samples, const LabelDataView &labels, const ForestParams &params, const AxisAlignedRandomSplitGenerator &generator) :
+        binned(binned), samples(samples), labels(labels), params(params), generator(generator), nClasses(params.n_classes), scratch(omp_get_max_threads()) {
+        for (auto &s : scratch) {
+            s.hist.assign(RF_HISTOGRAM_BINS * nClasses, 0);
+            s.counts.resize(nClasses);
+            s.classesL.resize(nClasses);
+            s.classesR.resize(nClasses);
+        }
+    }
+
+    void build(TreeNode *node, int *sampleIdxes, const size_t numSamples, RandomGen &gen) {
+        Scratch &s = scratch[omp_get_thread_num()];
+        std::vector<uint32_t> &hist = s.hist;
+        std::vector<uint64_t> &counts = s.counts;
+        std::vector<uint64_t> &classesL = s.classesL;
+        std::vector<uint64_t> &classesR = s.classesR;
+
+        node->n_samples = numSamples;
+        node->node_dist.assign(nClasses, 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < numSamples; i++) {
+            const int label = labels(sampleIdxes[i], 0);
+            node->node_dist[label] += 1.0f / numSamples;
+            counts[label]++;
+        }
+
+        const bool pure = std::count(counts.begin(), counts.end(), 0) >= nClasses - 1;
+        if (numSamples < params.min_samples_per_node || pure || node->depth >= params.max_depth) {
+            node->splitter.threshold = 0.0;
+            return;
+        }
+
+        AxisAlignedRandomSplitGenerator generator = this->generator;
+        generator.init(samples, labels, sampleIdxes, numSamples, nClasses, gen);
+
+        double bestLoss = std::numeric_limits<double>::infinity();
+        int bestFeature = -1;
+        int bestBin = 0;
+
+        for (size_t p = 0; p < generator.num_proposals(); p++) {
+            const int feature = generator.gen_proposal(gen).feature;
+            const uint8_t *col = binned.column(feature);
+
+            int lo = RF_HISTOGRAM_BINS, hi = -1;
+            for (size_t i = 0; i < numSamples; i++) {
+                const int idx = sampleIdxes[i];
+                const int b = col[idx];
+                hist[b * nClasses + labels(idx, 0)]++;
+                lo = std::min(lo, b);
+                hi = std::max(hi, b);
+            }
+
+            // Move one bin at a time from the right to the left side
+            std::fill(classesL.begin(), classesL.end(), 0);
+            std::copy(counts.begin(), counts.end(), classesR.begin());
+            double nL = 0, nR = numSamples;
+            for (int b = lo; b < hi; b++) {
+                const uint32_t *h = &hist[b * nClasses];
+                uint32_t binCount = 0;
+                for (size_t c = 0; c < nClasses; c++) {
+                    classesL[c] += h[c];
+                    classesR[c] -= h[c];
+                    binCount += h[c];
+                }
+                if (binCount == 0) continue;
+                nL += binCount;
+                nR -= binCount;
+
+                const double gini = nL - giniSquareTerm(classesL) / nL + nR - giniSquareTerm(classesR) / nR;
+                if (gini < bestLoss) {
+                    bestLoss = gini;
+                    bestFeature = feature;
+                    bestBin = b;
+                }
+            }
+
+            std::fill(hist.begin() + lo * nClasses, hist.begin() + (hi + 1) * nClasses, 0);
+        }
+
+        // All proposed features are constant in this node
+        if (bestFeature == -1) {
+            node->splitter.threshold = 0.0;
+            return;
+        }
+
+        node->is_leaf = false;
+        node->splitter.feature = bestFeature;
+        node->splitter.threshold = binned.cut(bestFeature, bestBin);
+
+        const uint8_t *col = binned.column(bestFeature);
+        const size_t numLeft = std::partition(sampleIdxes, sampleIdxes + numSamples, [col, bestBin](const int idx) {
+            return col[idx] <= bestBin;
+        }) - sampleIdxes;
+
+        node->left.reset(new TreeNode(node->depth + 1, &params));
+        node->right.reset(new TreeNode(node->depth + 1, &params));
+
+        // Each side gets its own generator, so that the tree does not depend
+        // on which side is built first. The left side of a node whose sides
+        // both have RF_TASK_MIN_SAMPLES samples is a task; other subtrees are
+        // built inline, without creating tasks.
+        RandomGen genLeft(gen());
+        RandomGen genRight(gen());
+        const size_t numRight = numSamples - numLeft;
+        if (numLeft >= RF_TASK_MIN_SAMPLES && numRight >= RF_TASK_MIN_SAMPLES) {
+            #pragma omp task shared(genLeft)
+            build(node->left.get(), sampleIdxes, numLeft, genLeft);
+            build(node->right.get(), sampleIdxes + numLeft, numRight, genRight);
+            #pragma omp taskwait
+        }
+        else {
+            build(node->left.get(), sampleIdxes, numLeft, genLeft);
+            build(node->right.get(), sampleIdxes + numLeft, numRight, genRight);
+        }
+    }
+private:
+    static double giniSquareTerm(const std::vector<uint64_t> &frequencies) {
+        return std::inner_product(frequencies.begin(), frequencies.end(), frequencies.begin(), uint64_t(0));
+    }
+
+    const BinnedFeatures &binned;
+    const FeatureDataView &samples;
+    const LabelDataView &labels;
+    const ForestParams &params;
+    const AxisAlignedRandomSplitGenerator &generator;
+    const size_t nClasses;
+    std::vector<Scratch> scratch;
+};
+
+// Same bagging and seeds as RandomForest::train, with trees grown by
+// HistogramTreeBuilder
+static void trainHistogram(RandomForest *rtrees, const FeatureDataView &samples, const LabelDataView &labels, const AxisAlignedRandomSplitGenerator &generator) {
+    ForestParams &params = rtrees->params;
+    params.n_classes = *std::max_element(&labels(0, 0), &labels(0, 0) + labels.rows) + 1;
+    params.n_features = samples.cols;
+    params.n_samples = samples.rows;
+    params.n_in_bag_samples = params.n_samples * (1 - params.sample_reduction);
+
+    std::cout << "Binning features..." << std::endl;
+    const BinnedFeatures binned(samples);
+
+    rtrees->trees.clear();
+    for (size_t t = 0; t < params.n_trees; t++) rtrees->trees.push_back(std::make_shared<RandomForest::TreeType>(&params));
+
+    HistogramTreeBuilder builder(binned, samples, labels, params, generator);
+
+    // Idle threads pick up the subtree tasks of other trees
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long long int t = 0; t < static_cast<long long int>(params.n_trees); t++) {
+        RandomGen gen(t);
+        liblearning::RandomForest::UniformIntDist dist(0, params.n_samples - 1);
+        std::vector<int> inBag(params.n_in_bag_samples);
+        for (auto &idx : inBag) idx = dist(gen);
+
+        auto &tree = rtrees->trees[t];
+        tree->root_node.reset(new RandomForest::TreeType::NodeType(0, &params));
+        builder.build(tree->root_node.get(), inBag.data(), inBag.size(), gen);
+    }
+}
+
+SplitFinder parseSplitFinder(const std::string &splitFinder) {
+    if (splitFinder == "exact") return ExactSplit;
+    if (splitFinder == "histogram") return HistogramSplit;
+    throw std::runtime_error("Invalid split finder value: " + splitFinder);
+}
+
+Inference parseInference(const std::string &inference) {
+    if (inference == "flat") return FlatInference;
+    if (inference == "quickscorer") return QuickScorerInference;
+    throw std::runtime_error("Invalid inference value: " + inference);
+}
+
 RandomForest *train(const std::vector<std::string> &filenames,
     double *startResolution,
     const int numScales,
@@ -9,7 +250,9 @@ RandomForest *train(const std::vector<std::string> &filenames,
     const int treeDepth,
     const double radius,
     const int maxSamples,
-    const std::vector<int> &classes) {
+    const std::vector<int> &classes,
+    const SplitFinder splitFinder,
+    const size_t sampleMemory) {
 
     ForestParams params;
     params.n_trees = numTrees;
@@ -17,24 +260,19 @@ RandomForest *train(const std::vector<std::string> &filenames,
     auto *rtrees = new RandomForest(params);
     const AxisAlignedRandomSplitGenerator generator;
 
-    std::vector<float> ft;
-    std::vector<int> gt;
-
-    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes,
-        [&ft, &gt](const std::vector<Feature *> &features, size_t idx, int g) {
-            for (std::size_t f = 0; f < features.size(); f++) {
-                ft.push_back(features[f]->getValue(idx));
-            }
-            gt.push_back(g);
-        },
-        [](size_t numFeatures, int numClasses) {});
-    std::cout << "Using " << gt.size() << " inliers" << std::endl;
+    SampleStore samples(sampleMemory);
+    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes, samples);
+    if (samples.rows() == 0) throw std::runtime_error("No training samples");
+    std::cout << "Using " << samples.rows() << " inliers" << std::endl;
 
+    // The features are used in place; the trainer wants int labels
+    std::vector<int> gt(samples.labels(), samples.labels() + samples.rows());
     const LabelDataView label_vector(gt.data(), gt.size(), 1);
-    const FeatureDataView feature_vector(ft.data(), gt.size(), ft.size() / gt.size());
+    const FeatureDataView feature_vector(samples.features(), samples.rows(), samples.cols());
 
     std::cout << "Training..." << std::endl;
-    rtrees->train(feature_vector, label_vector, LabelDataView(), generator, 0, false, false);
+    if (splitFinder == HistogramSplit) trainHistogram(rtrees, feature_vector, label_vector, generator);
+    else rtrees->train(feature_vector, label_vector, LabelDataView(), generator, 0, false, false);
 
     rtrees->params.resolution = *startResolution;
     rtrees->params.radius = radius;
@@ -61,9 +299,461 @@ RandomForest *loadForest(const std::string &modelFilename) {
     return rtrees;
 }
 
+FlatForest *loadFlatForest(const std::string &modelFilename) {
+    if (fingerprint(modelFilename) == FlatRandomForest) {
+        std::cout << "Loading " << modelFilename << std::endl;
+        return new FlatForest(modelFilename);
+    }
+
+    const RandomForest *rtrees = loadForest(modelFilename);
+    const auto forest = new FlatForest(*rtrees);
+    delete rtrees;
+    return forest;
+}
+
+void saveFlatForest(const FlatForest &forest, const std::string &modelFilename) {
+    std::ofstream ofs(modelFilename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("Cannot write " + modelFilename);
+    forest.write(ofs);
+
+    std::cout << "Saved " << modelFilename << std::endl;
+}
+
+FlatForest::FlatForest(const RandomForest &forest) : params(forest.params), nClasses(forest.params.n_classes), nLeafBits(32) {
+    typedef RandomForest::TreeType::NodeType TreeNode;
+
+    std::vector<float> values;
+
+    for (const auto &tree : forest.trees) {
+        const uint32_t base = nodeStorage.size();
+        rootStorage.push_back(base);
+
+        // Breadth-first: children are queued (and numbered) together
+        std::vector<const TreeNode *> queue = { tree->root_node.get() };
+        for (size_t i = 0; i < queue.size(); i++) {
+            const TreeNode *n = queue[i];
+            Node node;
+
+            if (n->is_leaf) {
+                node.feature = -1;
+                node.threshold = 0.0f;
+                node.child = values.size();
+                values.insert(values.end(), n->node_dist.begin(), n->node_dist.end());
+            }
+            else {
+                node.feature = n->splitter.feature;
+                node.threshold = n->splitter.threshold;
+                node.child = base + queue.size();
+                queue.push_back(n->left.get());
+                queue.push_back(n->right.get());
+            }
+
+            nodeStorage.push_back(node);
+        }
+    }
+
+    leafStorage.resize(values.size() * sizeof(float));
+    std::memcpy(leafStorage.data(), values.data(), leafStorage.size());
+
+    nTrees = rootStorage.size();
+    nNodes = nodeStorage.size();
+    nLeaves = values.size();
+    roots = rootStorage.data();
+    nodes = nodeStorage.data();
+    leaves = leafStorage.data();
+}
+
+static inline uint16_t swapBytes(const uint16_t v) {
+    return (v >> 8) | (v << 8);
+}
+
+static inline uint32_t swapBytes(const uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0x0000ff00) | ((v << 8) & 0x00ff0000) | (v << 24);
+}
+
+template <typename T>
+static inline T swapBytes(const T v) {
+    static_assert(sizeof(T) == 8, "Only 64 bit values are swapped through memcpy");
+    uint64_t u;
+    std::memcpy(&u, &v, sizeof(u));
+    u = (static_cast<uint64_t>(swapBytes(static_cast<uint32_t>(u))) << 32) | swapBytes(static_cast<uint32_t>(u >> 32));
+    T r;
+    std::memcpy(&r, &u, sizeof(r));
+    return r;
+}
+
+// Swap the byte order of count elements of type U stored (unaligned) at data
+template <typename U>
+static void swapArray(void *data, const size_t count) {
+    char *p = static_cast<char *>(data);
+    for (size_t i = 0; i < count; i++, p += sizeof(U)) {
+        U v;
+        std::memcpy(&v, p, sizeof(U));
+        v = swapBytes(v);
+        std::memcpy(p, &v, sizeof(U));
+    }
+}
+
+FlatForest::FlatForest(const std::string &modelFilename) : file(new MappedFile(modelFilename, false)) {
+    // Version 1 headers end before leafBits
+    const size_t v1HeaderSize = offsetof(FlatForestHeader, leafBits);
+
+    FlatForestHeader h;
+    if (file->size() < v1HeaderSize) throw std::runtime_error("Invalid model file " + modelFilename);
+    std::memcpy(&h, file->data(), v1HeaderSize);
+    if (std::memcmp(h.magic, FLAT_FOREST_MAGIC, sizeof(h.magic)) != 0) throw std::runtime_error("Invalid model file " + modelFilename);
+
+    // Written on a machine with the opposite byte order
+    const bool swap = h.byteOrder != FLAT_FOREST_BYTE_ORDER;
+    if (swap) {
+        h.byteOrder = swapBytes(h.byteOrder);
+        h.version = swapBytes(h.version);
+        h.numClasses = swapBytes(h.numClasses);
+        h.numFeatures = swapBytes(h.numFeatures);
+        h.numTrees = swapBytes(h.numTrees);
+        h.maxDepth = swapBytes(h.maxDepth);
+        h.numScales = static_cast<int32_t>(swapBytes(static_cast<uint32_t>(h.numScales)));
+        h.resolution = swapBytes(h.resolution);
+        h.radius = swapBytes(h.radius);
+        h.numNodes = swapBytes(h.numNodes);
+        h.numLeaves = swapBytes(h.numLeaves);
+        if (h.byteOrder != FLAT_FOREST_BYTE_ORDER) throw std::runtime_error("Invalid model file " + modelFilename);
+    }
+
+    size_t headerSize = sizeof(h);
+    if (h.version == 1) {
+        headerSize = v1HeaderSize;
+        h.leafBits = 32;
+    }
+    else if (h.version == FLAT_FOREST_VERSION) {
+        if (file->size() < sizeof(h)) throw std::runtime_error("Invalid model file " + modelFilename);
+        std::memcpy(&h.leafBits, file->data() + v1HeaderSize, sizeof(h) - v1HeaderSize);
+        if (swap) h.leafBits = swapBytes(h.leafBits);
+    }
+    else throw std::runtime_error("Unsupported model version " + std::to_string(h.version) + " in " + modelFilename);
+
+    if (h.leafBits != 8 && h.leafBits != 16 && h.leafBits != 32) throw std::runtime_error("Invalid model file " + modelFilename);
+
+    params.n_classes = h.numClasses;
+    params.n_features = h.numFeatures;
+    params.n_trees = h.numTrees;
+    params.max_depth = h.maxDepth;
+    params.numScales = h.numScales;
+    params.resolution = h.resolution;
+    params.radius = h.radius;
+    nClasses = h.numClasses;
+    nTrees = h.numTrees;
+    nNodes = h.numNodes;
+    nLeaves = h.numLeaves;
+    nLeafBits = h.leafBits;
+
+    const size_t leafBytes = nLeaves * nLeafBits / 8;
+    if (file->size() < headerSize + nTrees * sizeof(uint32_t) + nNodes * sizeof(Node) + leafBytes)
+        throw std::runtime_error("Invalid model file " + modelFilename + " (unexpected end of file)");
+
+    const char *data = file->data() + headerSize;
+    roots = reinterpret_cast<const uint32_t *>(data);
+    nodes = reinterpret_cast<const Node *>(data + nTrees * sizeof(uint32_t));
+    leaves = data + nTrees * sizeof(uint32_t) + nNodes * sizeof(Node);
+
+    if (swap) {
+        // All node fields are 4 bytes wide
+        rootStorage.assign(roots, roots + nTrees);
+        nodeStorage.assign(nodes, nodes + nNodes);
+        leafStorage.assign(static_cast<const char *>(leaves), static_cast<const char *>(leaves) + leafBytes);
+        swapArray<uint32_t>(rootStorage.data(), nTrees);
+        swapArray<uint32_t>(nodeStorage.data(), nNodes * 3);
+        if (nLeafBits == 32) swapArray<uint32_t>(leafStorage.data(), nLeaves);
+        else if (nLeafBits == 16) swapArray<uint16_t>(leafStorage.data(), nLeaves);
+
+        roots = rootStorage.data();
+        nodes = nodeStorage.data();
+        leaves = leafStorage.data();
+        file.reset();
+    }
+}
+
+void FlatForest::write(std::ostream &os) const {
+    static_assert(sizeof(FlatForestHeader) == 72, "Unexpected FlatForestHeader padding");
+    static_assert(sizeof(Node) == 12, "Unexpected FlatForest::Node padding");
+
+    FlatForestHeader h;
+    std::memcpy(h.magic, FLAT_FOREST_MAGIC, sizeof(h.magic));
+    h.byteOrder = FLAT_FOREST_BYTE_ORDER;
+    h.version = FLAT_FOREST_VERSION;
+    h.numClasses = params.n_classes;
+    h.numFeatures = params.n_features;
+    h.numTrees = nTrees;
+    h.maxDepth = params.max_depth;
+    h.numScales = params.numScales;
+    h.resolution = params.resolution;
+    h.radius = params.radius;
+    h.numNodes = nNodes;
+    h.numLeaves = nLeaves;
+    h.leafBits = nLeafBits;
+    h.reserved = 0;
+
+    os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    os.write(reinterpret_cast<const char *>(roots), nTrees * sizeof(uint32_t));
+    os.write(reinterpret_cast<const char *>(nodes), nNodes * sizeof(Node));
+    os.write(static_cast<const char *>(leaves), nLeaves * nLeafBits / 8);
+}
+
+void FlatForest::quantize(const int leafBits) {
+    if (leafBits != 8 && leafBits != 16) throw std::runtime_error("Invalid leaf bits: " + std::to_string(leafBits));
+    if (nLeafBits != 32) throw std::runtime_error("The model is already quantized");
+
+    const float *values = static_cast<const float *>(leaves);
+    const float one = (1 << leafBits) - 1;
+    std::vector<char> storage(nLeaves * leafBits / 8);
+
+    for (size_t i = 0; i < nLeaves; i++) {
+        const long v = std::lround(std::min(1.0f, std::max(0.0f, values[i])) * one);
+        if (leafBits == 8) reinterpret_cast<uint8_t *>(storage.data())[i] = static_cast<uint8_t>(v);
+        else reinterpret_cast<uint16_t *>(storage.data())[i] = static_cast<uint16_t>(v);
+    }
+
+    // Roots and nodes may still be mapped from a model file
+    leafStorage.swap(storage);
+    leaves = leafStorage.data();
+    nLeafBits = leafBits;
+}
+
+float FlatForest::leafValue(const Node &node, const size_t c) const {
+    switch (nLeafBits) {
+    case 8: return static_cast<const uint8_t *>(leaves)[node.child + c];
+    case 16: return static_cast<const uint16_t *>(leaves)[node.child + c];
+    default: return static_cast<const float *>(leaves)[node.child + c];
+    }
+}
+
+int FlatForest::evaluate(const float *sample, float *results) const {
+    evaluateBatch(sample, 1, 0, results, nClasses);
+    return std::max_element(results, results + nClasses) - results;
+}
+
+void FlatForest::evaluateBatch(const float *samples, const size_t count, const size_t stride, float *results, const size_t resultStride) const {
+    if (nLeafBits == 32) {
+        vote<float>(samples, count, stride, results, resultStride);
+    }
+    else {
+        // Fixed point votes are added up exactly in integers
+        std::vector<uint32_t> votes(count * nClasses);
+        if (nLeafBits == 16) vote<uint16_t>(samples, count, stride, votes.data(), nClasses);
+        else vote<uint8_t>(samples, count, stride, votes.data(), nClasses);
+
+        for (size_t i = 0; i < count; i++) {
+            for (size_t c = 0; c < nClasses; c++) results[i * resultStride + c] = votes[i * nClasses + c];
+        }
+    }
+
+    // Average the votes of the trees
+    const float scale = leafUnit() / nTrees;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t c = 0; c < nClasses; c++) results[i * resultStride + c] *= scale;
+    }
+}
+
+// Add up the leaf values (type L) reached by each sample into votes
+template <typename L, typename A>
+void FlatForest::vote(const float *samples, const size_t count, const size_t stride, A *votes, const size_t voteStride) const {
+    for (size_t i = 0; i < count; i++) std::fill_n(votes + i * voteStride, nClasses, A(0));
+
+    // Loop over groups of trees first, so that the nodes of a group stay in
+    // cache while the whole batch goes through it
+    for (size_t t = 0; t < nTrees; t += RF_INTERLEAVE) {
+        const size_t groupTrees = std::min<size_t>(RF_INTERLEAVE, nTrees - t);
+        for (size_t i = 0; i < count; i++) {
+            walk<L>(t, groupTrees, samples + i * stride, votes + i * voteStride);
+        }
+    }
+}
+
+// Walk count trees (at most RF_INTERLEAVE) together so that their independent
+// node fetches overlap, then add up their votes in tree order
+template <typename L, typename A>
+void FlatForest::walk(const size_t firstTree, const size_t count, const float *sample, A *votes) const {
+    const Node *walk[RF_INTERLEAVE];
+    for (size_t w = 0; w < count; w++) walk[w] = &nodes[roots[firstTree + w]];
+
+    bool split = true;
+    while (split) {
+        split = false;
+        for (size_t w = 0; w < count; w++) {
+            const Node *node = walk[w];
+            if (node->feature >= 0) {
+                walk[w] = &nodes[node->child + (sample[node->feature] > node->threshold)];
+                split = true;
+            }
+        }
+    }
+
+    for (size_t w = 0; w < count; w++) {
+        const L *dist = static_cast<const L *>(leaves) + walk[w]->child;
+        for (size_t c = 0; c < nClasses; c++) votes[c] += dist[c];
+    }
+}
+
+// Number of leaves of the subtree at node, or more than 64 once it is known
+// to have more than 64
+static size_t countLeaves(const FlatForest &forest, const FlatForest::Node &node) {
+    if (node.feature < 0) return 1;
+    const size_t left = countLeaves(forest, forest.left(node));
+    if (left > 64) return left;
+    return left + countLeaves(forest, forest.right(node));
+}
+
+bool QuickScorer::supports(const FlatForest &forest) {
+    for (size_t t = 0; t < forest.numTrees(); t++) {
+        if (countLeaves(forest, forest.root(t)) > 64) return false;
+    }
+    return true;
+}
+
+QuickScorer::QuickScorer(const FlatForest &forest) : nClasses(forest.numClasses()), nTrees(forest.numTrees()), nFeatures(forest.params.n_features),
+    nLeafBits(forest.leafBits()), scale(forest.leafUnit() / forest.numTrees()) {
+    if (!supports(forest)) throw std::runtime_error("QuickScorer only supports trees of at most 64 leaves (max depth 6)");
+
+    struct Condition {
+        uint32_t feature;
+        float threshold;
+        uint32_t tree;
+        uint64_t mask;
+    };
+    std::vector<Condition> conditions;
+
+    if (nLeafBits == 32) floatLeaves.assign(nTrees * 64 * nClasses, 0.0f);
+    else fixedLeaves.assign(nTrees * 64 * nClasses, 0);
+
+    for (size_t t = 0; t < nTrees; t++) {
+        // Number the leaves left to right; a sample that goes right at a node
+        // can't exit in the leaves [begin, end) of its left subtree
+        uint32_t numLeaves = 0;
+        const std::function<void(const FlatForest::Node &)> visit = [&](const FlatForest::Node &node) {
+            if (node.feature < 0) {
+                const size_t offset = (t * 64 + numLeaves) * nClasses;
+                for (size_t c = 0; c < nClasses; c++) {
+                    if (nLeafBits == 32) floatLeaves[offset + c] = forest.leafValue(node, c);
+                    else fixedLeaves[offset + c] = static_cast<uint16_t>(forest.leafValue(node, c));
+                }
+                numLeaves++;
+                return;
+            }
+
+            const uint32_t begin = numLeaves;
+            visit(forest.left(node));
+            const uint32_t end = numLeaves;
+            const uint64_t left = end - begin == 64 ? ~0ULL : ((1ULL << (end - begin)) - 1) << begin;
+            conditions.push_back({ static_cast<uint32_t>(node.feature), node.threshold, static_cast<uint32_t>(t), ~left });
+            visit(forest.right(node));
+        };
+        visit(forest.root(t));
+    }
+
+    std::stable_sort(conditions.begin(), conditions.end(), [](const Condition &a, const Condition &b) {
+        if (a.feature != b.feature) return a.feature < b.feature;
+        return a.threshold < b.threshold;
+    });
+
+    features.assign(nFeatures + 1, 0);
+    thresholds.reserve(conditions.size());
+    conditionTrees.reserve(conditions.size());
+    conditionMasks.reserve(conditions.size());
+    for (const Condition &c : conditions) {
+        if (c.feature >= nFeatures) throw std::runtime_error("Invalid split feature in forest");
+        features[c.feature + 1]++;
+        thresholds.push_back(c.threshold);
+        conditionTrees.push_back(c.tree);
+        conditionMasks.push_back(c.mask);
+    }
+    for (size_t f = 1; f < features.size(); f++) features[f] += features[f - 1];
+}
+
+int QuickScorer::evaluate(const float *sample, float *results) const {
+    evaluateBatch(sample, 1, 0, results, nClasses);
+    return std::max_element(results, results + nClasses) - results;
+}
+
+void QuickScorer::evaluateBatch(const float *samples, const size_t count, const size_t stride, float *results, const size_t resultStride) const {
+    std::vector<float> values(nFeatures * RF_QUICKSCORER_BLOCK);
+    std::vector<uint64_t> masks(nTrees * RF_QUICKSCORER_BLOCK);
+    std::vector<uint32_t> votes(nLeafBits == 32 ? 0 : RF_QUICKSCORER_BLOCK * nClasses);
+
+    for (size_t first = 0; first < count; first += RF_QUICKSCORER_BLOCK) {
+        const size_t n = std::min<size_t>(RF_QUICKSCORER_BLOCK, count - first);
+        const float *block = samples + first * stride;
+        float *blockResults = results + first * resultStride;
+
+        exitLeaves(block, n, stride, values.data(), masks.data());
+
+        if (nLeafBits == 32) {
+            vote(masks.data(), n, floatLeaves.data(), blockResults, resultStride);
+        }
+        else {
+            // Fixed point votes are added up exactly in integers
+            vote(masks.data(), n, fixedLeaves.data(), votes.data(), nClasses);
+            for (size_t i = 0; i < n; i++) {
+                for (size_t c = 0; c < nClasses; c++) blockResults[i * resultStride + c] = votes[i * nClasses + c];
+            }
+        }
+
+        // Average the votes of the trees
+        for (size_t i = 0; i < n; i++) {
+            for (size_t c = 0; c < nClasses; c++) blockResults[i * resultStride + c] *= scale;
+        }
+    }
+}
+
+// Compute the leaf mask of every tree for count samples (at most
+// RF_QUICKSCORER_BLOCK), stored tree by tree in masks. values holds the
+// samples transposed, feature by feature, padded with NaN (which never goes
+// right, like in FlatForest::walk).
+void QuickScorer::exitLeaves(const float *samples, const size_t count, const size_t stride, float *values, uint64_t *masks) const {
+    const size_t B = RF_QUICKSCORER_BLOCK;
+
+    for (size_t f = 0; f < nFeatures; f++) {
+        for (size_t i = 0; i < B; i++) values[f * B + i] = i < count ? samples[i * stride + f] : std::numeric_limits<float>::quiet_NaN();
+    }
+    std::fill_n(masks, nTrees * B, ~0ULL);
+
+    for (size_t f = 0; f < nFeatures; f++) {
+        const float *v = values + f * B;
+        float maxValue = -std::numeric_limits<float>::infinity();
+        for (size_t i = 0; i < B; i++) {
+            if (v[i] > maxValue) maxValue = v[i];
+        }
+
+        // Thresholds are sorted, so once no sample is above one, no sample
+        // goes right at the remaining conditions
+        for (uint32_t e = features[f]; e < features[f + 1] && maxValue > thresholds[e]; e++) {
+            uint64_t *m = masks + conditionTrees[e] * B;
+            const float threshold = thresholds[e];
+            const uint64_t mask = conditionMasks[e];
+            for (size_t i = 0; i < B; i++) m[i] &= v[i] > threshold ? mask : ~0ULL;
+        }
+    }
+}
+
+// Add up the values (type L) of the exit leaves (the first leaf left in the
+// mask of each tree) into votes, in tree order like FlatForest::vote
+template <typename L, typename A>
+void QuickScorer::vote(const uint64_t *masks, const size_t count, const L *leaves, A *votes, const size_t voteStride) const {
+    for (size_t i = 0; i < count; i++) std::fill_n(votes + i * voteStride, nClasses, A(0));
+
+    for (size_t t = 0; t < nTrees; t++) {
+        const uint64_t *m = masks + t * RF_QUICKSCORER_BLOCK;
+        const L *treeLeaves = leaves + t * 64 * nClasses;
+        for (size_t i = 0; i < count; i++) {
+            const L *dist = treeLeaves + __builtin_ctzll(m[i]) * nClasses;
+            A *v = votes + i * voteStride;
+            for (size_t c = 0; c < nClasses; c++) v[c] += dist[c];
+        }
+    }
+}
+
 void classify(PointSet &pointSet,
-    RandomForest *rtrees,
-    const std::vector<Feature *> &features,
+    const FlatForest &forest,
+    const FeatureMatrix &features,
     const std::vector<Label> &labels,
     const Regularization regularization,
     const double regRadius,
@@ -71,10 +761,24 @@ void classify(PointSet &pointSet,
     const bool unclassifiedOnly,
     const bool evaluate,
     const std::vector<int> &skip,
-    const std::string &statsFile) {
+    const std::string &statsFile,
+    const Inference inference) {
+    const size_t numFeatures = features.cols();
+    const size_t numLabels = labels.size();
+
+    if (inference == QuickScorerInference) {
+        const QuickScorer scorer(forest);
+        classifyData<float>(pointSet,
+            [&scorer, numFeatures, numLabels](const float *ft, const size_t count, float *probs) {
+                scorer.evaluateBatch(ft, count, numFeatures, probs, numLabels);
+            },
+            features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile);
+        return;
+    }
+
     classifyData<float>(pointSet,
-        [&rtrees](const float *ft, float *probs) {
-            rtrees->evaluate(ft, probs);
+        [&forest, numFeatures, numLabels](const float *ft, const size_t count, float *probs) {
+            forest.evaluateBatch(ft, count, numFeatures, probs, numLabels);
         },
         features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile);
 }
@@ -2,12 +2,30 @@
 #define RANDOMFOREST_H
 
 #include <ostream>
+#include <memory>
 
 #include "random-forest/node-gini.hpp"
 #include "random-forest/forest.hpp"
 
 #include "classifier.hpp"
 
+// Number of trees walked together by FlatForest::evaluate
+#define RF_INTERLEAVE 8
+
+// Number of samples scored together by QuickScorer
+#define RF_QUICKSCORER_BLOCK 32
+
+// Maximum number of bins of each feature for the histogram split finder
+#define RF_HISTOGRAM_BINS 256
+
+// Nodes whose sides both have at least this many samples build their left
+// subtree as an OpenMP task (histogram split finder)
+#define RF_TASK_MIN_SAMPLES 2048
+
+#define FLAT_FOREST_MAGIC "OPCF"
+#define FLAT_FOREST_VERSION 2
+#define FLAT_FOREST_BYTE_ORDER 0x01020304
+
 namespace rf {
 
 typedef liblearning::RandomForest::RandomForest< liblearning::RandomForest::NodeGini<liblearning::RandomForest::AxisAlignedSplitter> > RandomForest;
@@ -15,7 +33,155 @@ typedef liblearning::RandomForest::AxisAlignedRandomSplitGenerator AxisAlignedRa
 typedef liblearning::RandomForest::ForestParams ForestParams;
 typedef liblearning::DataView2D<int> LabelDataView;
 typedef liblearning::DataView2D<float> FeatureDataView;
+typedef liblearning::RandomForest::RandomGen RandomGen;
+
+// Header of a flat forest model file. Every field, and every element of the
+// arrays that follow, is stored in the byte order of the machine that wrote
+// the file, as recorded by byteOrder. Version 1 files end the header at
+// numLeaves and always have float leaves.
+struct FlatForestHeader {
+    char magic[4]; // FLAT_FOREST_MAGIC
+    uint32_t byteOrder; // FLAT_FOREST_BYTE_ORDER
+    uint32_t version;
+    uint32_t numClasses;
+    uint32_t numFeatures;
+    uint32_t numTrees;
+    uint32_t maxDepth;
+    int32_t numScales;
+    double resolution;
+    double radius;
+    uint64_t numNodes;
+    uint64_t numLeaves; // values in the leaf pool
+    uint32_t leafBits; // 32 (float), 16 or 8 (fixed point)
+    uint32_t reserved;
+};
+
+// Random forest flattened into contiguous arrays for inference. The nodes of
+// each tree are stored breadth-first, so that the two children of a node are
+// adjacent, and leaf class distributions live in a separate pool.
+//
+// The arrays are also the model file format (FLAT_FOREST_MAGIC): a
+// FlatForestHeader followed by the roots, nodes and leaves. A loaded model is
+// used in place from the memory-mapped file.
+//
+// Leaf probabilities are floats, or fixed point values (see quantize) whose
+// votes are added up in integers.
+class FlatForest {
+public:
+    struct Node {
+        int32_t feature; // split feature, -1 for leaves
+        float threshold; // samples with a value above the threshold go right
+        uint32_t child; // index of the left child (right is child + 1), or leaf offset in the pool
+    };
+
+    explicit FlatForest(const RandomForest &forest);
+    explicit FlatForest(const std::string &modelFilename);
+
+    FlatForest(const FlatForest &) = delete;
+    FlatForest &operator=(const FlatForest &) = delete;
+
+    void write(std::ostream &os) const;
+
+    // Store leaf probabilities as leafBits (8 or 16) bit fixed point
+    void quantize(int leafBits);
+
+    // Same results as RandomForest::evaluate
+    int evaluate(const float *sample, float *results) const;
+
+    // Evaluate count samples (stride floats apart) at once, writing the
+    // numClasses() probabilities of each sample resultStride floats apart.
+    // Same results as calling evaluate on each sample.
+    void evaluateBatch(const float *samples, size_t count, size_t stride, float *results, size_t resultStride) const;
+
+    size_t numClasses() const { return nClasses; }
+    size_t numTrees() const { return nTrees; }
+    const Node &root(size_t tree) const { return nodes[roots[tree]]; }
+    const Node &left(const Node &node) const { return nodes[node.child]; }
+    const Node &right(const Node &node) const { return nodes[node.child + 1]; }
+    int leafBits() const { return nLeafBits; }
+    // Stored probability of class c in a leaf, in units of leafUnit()
+    float leafValue(const Node &node, size_t c) const;
+    double leafUnit() const { return nLeafBits == 32 ? 1.0 : 1.0 / ((1 << nLeafBits) - 1); }
 
+    ForestParams params;
+private:
+    template <typename L, typename A>
+    void vote(const float *samples, size_t count, size_t stride, A *votes, size_t voteStride) const;
+    template <typename L, typename A>
+    void walk(size_t firstTree, size_t count, const float *sample, A *votes) const;
+
+    size_t nClasses;
+    size_t nTrees;
+    size_t nNodes;
+    size_t nLeaves;
+    int nLeafBits;
+    const uint32_t *roots;
+    const Node *nodes;
+    const void *leaves;
+
+    // Storage of the arrays, unless they are mapped from a model file
+    std::unique_ptr<MappedFile> file;
+    std::vector<uint32_t> rootStorage;
+    std::vector<Node> nodeStorage;
+    std::vector<char> leafStorage;
+};
+
+// QuickScorer-style evaluation of shallow forests, whose trees have at most
+// 64 leaves (max depth 6 or less): instead of walking the trees, the split
+// conditions of each feature are scanned in threshold order, and every false
+// condition (the sample goes right) clears the leaves of its left subtree
+// from the 64-bit leaf mask of its tree. The exit leaf of a tree is then the
+// first set bit of its mask. Samples are scored in blocks of
+// RF_QUICKSCORER_BLOCK, so that applying a condition is a branch-free loop
+// over the block, and the scan of a feature stops at the first threshold
+// that no sample of the block is above.
+class QuickScorer {
+public:
+    // Throws if a tree of the forest has more than 64 leaves
+    explicit QuickScorer(const FlatForest &forest);
+
+    // Whether every tree of the forest has at most 64 leaves
+    static bool supports(const FlatForest &forest);
+
+    // Same results as FlatForest::evaluate
+    int evaluate(const float *sample, float *results) const;
+
+    // Same results as FlatForest::evaluateBatch
+    void evaluateBatch(const float *samples, size_t count, size_t stride, float *results, size_t resultStride) const;
+
+    size_t numClasses() const { return nClasses; }
+private:
+    void exitLeaves(const float *samples, size_t count, size_t stride, float *values, uint64_t *masks) const;
+    template <typename L, typename A>
+    void vote(const uint64_t *masks, size_t count, const L *leaves, A *votes, size_t voteStride) const;
+
+    size_t nClasses;
+    size_t nTrees;
+    size_t nFeatures;
+    int nLeafBits;
+    float scale; // from summed leaf values to probabilities
+
+    // Conditions on feature f are [features[f], features[f + 1]), sorted by
+    // threshold, each with its tree and the mask that clears its left subtree
+    std::vector<uint32_t> features;
+    std::vector<float> thresholds;
+    std::vector<uint32_t> conditionTrees;
+    std::vector<uint64_t> conditionMasks;
+
+    // Class values of leaf l (left to right) of tree t at (t * 64 + l) * nClasses,
+    // in floatLeaves for float forests, fixedLeaves for quantized ones
+    std::vector<float> floatLeaves;
+    std::vector<uint16_t> fixedLeaves;
+};
+
+enum Inference { FlatInference, QuickScorerInference };
+Inference parseInference(const std::string &inference);
+
+// How the thresholds of the splits are found during training: by sorting the
+// samples of each node (exact), or from class histograms of features
+// quantized once into at most RF_HISTOGRAM_BINS bins (histogram)
+enum SplitFinder { ExactSplit, HistogramSplit };
+SplitFinder parseSplitFinder(const std::string &splitFinder);
 
 RandomForest *train(const std::vector<std::string> &filenames,
     double *startResolution,
@@ -24,14 +190,20 @@ RandomForest *train(const std::vector<std::string> &filenames,
     int treeDepth,
     double radius,
     int maxSamples,
-    const std::vector<int> &classes);
+    const std::vector<int> &classes,
+    SplitFinder splitFinder = ExactSplit,
+    size_t sampleMemory = 0);
 
 RandomForest *loadForest(const std::string &modelFilename);
 void saveForest(RandomForest *rtrees, const std::string &modelFilename);
 
+// Load a model in either format (see fingerprint) for classification
+FlatForest *loadFlatForest(const std::string &modelFilename);
+void saveFlatForest(const FlatForest &forest, const std::string &modelFilename);
+
 void classify(PointSet &pointSet,
-    RandomForest *rtrees,
-    const std::vector<Feature *> &features,
+    const FlatForest &forest,
+    const FeatureMatrix &features,
     const std::vector<Label> &labels,
     Regularization regularization = Regularization::None,
     double regRadius = 2.5,
@@ -39,7 +211,8 @@ void classify(PointSet &pointSet,
     bool unclassifiedOnly = false,
     bool evaluate = false,
     const std::vector<int> &skip = {},
-    const std::string &statsFile = "");
+    const std::string &statsFile = "",
+    Inference inference = FlatInference);
 
 }
 #endif
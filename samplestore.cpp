@@ -0,0 +1,125 @@
+#include <iostream>
+#include <filesystem>
+#include <cstring>
+#include <new>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "samplestore.hpp"
+
+namespace fs = std::filesystem;
+
+SampleStore::SampleStore(const size_t memoryLimit) : memoryLimit(memoryLimit) {}
+
+SampleStore::~SampleStore() {
+#ifndef _WIN32
+    if (fd != -1) {
+        if (ptr != nullptr) munmap(ptr, capacity * numCols * sizeof(float));
+        close(fd);
+    }
+#endif
+}
+
+void SampleStore::init(const size_t cols) {
+    if (numRows > 0) throw std::runtime_error("Cannot change the number of features of a non-empty sample store");
+    numCols = cols;
+}
+
+float *SampleStore::append(const uint8_t *labels, const size_t count) {
+    if (numCols == 0) throw std::runtime_error("Sample store is not initialized");
+    if (numRows + count > capacity) grow(numRows + count);
+
+    labelData.insert(labelData.end(), labels, labels + count);
+    float *rows = ptr + numRows * numCols;
+    numRows += count;
+    return rows;
+}
+
+void SampleStore::reserve(size_t rows) {
+    if (numCols == 0) throw std::runtime_error("Sample store is not initialized");
+    if (rows <= capacity) return;
+
+    // Grow like append would, but only spill once the rows themselves
+    // outgrow memoryLimit
+    rows = roundCapacity(rows);
+    if (memoryLimit > 0 && !spilled()) rows = std::max(capacity, std::min(rows, memoryLimit / (numCols * sizeof(float))));
+    if (rows <= capacity) return;
+
+    try {
+        allocate(rows);
+    } catch (const std::bad_alloc &) {
+        std::cout << "Cannot reserve memory for " << rows << " training samples" << std::endl;
+    }
+}
+
+size_t SampleStore::roundCapacity(const size_t rows) const {
+    // Grow geometrically, rounded to whole chunks
+    const size_t newCapacity = std::max(rows, capacity + capacity / 2);
+    return (newCapacity + SAMPLE_STORE_CHUNK_ROWS - 1) / SAMPLE_STORE_CHUNK_ROWS * SAMPLE_STORE_CHUNK_ROWS;
+}
+
+void SampleStore::grow(const size_t rows) {
+    allocate(roundCapacity(rows));
+}
+
+void SampleStore::allocate(const size_t rows) {
+    labelData.reserve(rows);
+
+#ifndef _WIN32
+    if (spilled()) {
+        map(rows);
+        return;
+    }
+    if (memoryLimit > 0 && rows * numCols * sizeof(float) > memoryLimit) {
+        spill(rows);
+        return;
+    }
+#endif
+
+    // Left uninitialized, so that pages are only touched as rows are filled
+    std::unique_ptr<float[]> m(new float[rows * numCols]);
+    if (numRows > 0) std::memcpy(m.get(), memory.get(), numRows * numCols * sizeof(float));
+    memory = std::move(m);
+    ptr = memory.get();
+    capacity = rows;
+}
+
+#ifndef _WIN32
+void SampleStore::spill(const size_t rows) {
+    const std::string tmpl = (fs::temp_directory_path() / "opc-samples-XXXXXX").string();
+    std::vector<char> path(tmpl.begin(), tmpl.end());
+    path.push_back('\0');
+
+    fd = mkstemp(path.data());
+    if (fd == -1) throw std::runtime_error("Cannot create temporary file " + tmpl);
+
+    // Removed now, freed when closed
+    unlink(path.data());
+    std::cout << "Spilling training samples to " << path.data() << std::endl;
+
+    capacity = 0;
+    ptr = nullptr;
+    map(rows);
+
+    if (numRows > 0) std::memcpy(ptr, memory.get(), numRows * numCols * sizeof(float));
+    memory.reset();
+}
+
+void SampleStore::map(const size_t rows) {
+    const size_t bytes = rows * numCols * sizeof(float);
+    if (ftruncate(fd, bytes) == -1) throw std::runtime_error("Cannot grow sample store file");
+
+    if (ptr != nullptr) munmap(ptr, capacity * numCols * sizeof(float));
+    void *m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        ptr = nullptr;
+        throw std::runtime_error("Cannot map sample store file");
+    }
+
+    ptr = static_cast<float *>(m);
+    capacity = rows;
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef SAMPLESTORE_H
+#define SAMPLESTORE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+// Rows are allocated in multiples of this
+#define SAMPLE_STORE_CHUNK_ROWS 65536
+
+// Training samples: float32 feature rows (row-major, contiguous) and uint8
+// labels. Trainers read the rows in place. Capacity grows geometrically in
+// chunks of rows, ahead of appends when the caller knows how many rows are
+// coming (see reserve); once the features outgrow memoryLimit bytes (0 = no
+// limit) they are moved to an unlinked temporary file mapped in memory, which
+// grows without copying and lets the OS page samples out instead of running
+// out of memory.
+class SampleStore {
+    size_t numCols = 0;
+    size_t numRows = 0;
+    size_t capacity = 0; // rows
+    size_t memoryLimit;
+
+    float *ptr = nullptr;
+    std::unique_ptr<float[]> memory; // not zero-filled
+    std::vector<uint8_t> labelData;
+
+    int fd = -1; // spill file
+
+    size_t roundCapacity(size_t rows) const;
+    void grow(size_t rows);
+    void allocate(size_t rows);
+    void spill(size_t rows);
+    void map(size_t rows);
+public:
+    explicit SampleStore(size_t memoryLimit = 0);
+    ~SampleStore();
+
+    SampleStore(const SampleStore &) = delete;
+    SampleStore &operator=(const SampleStore &) = delete;
+
+    // Set the number of features per row (before adding rows)
+    void init(size_t cols);
+
+    // Make room for rows rows in total (after init), so that appending them
+    // moves the features at most once. Reserving does not spill the samples:
+    // capacity stops at memoryLimit bytes. Best effort: if the memory cannot
+    // be allocated, the store grows as rows are appended.
+    void reserve(size_t rows);
+
+    // Append count rows with the given labels and return a pointer to
+    // their features, to be filled by the caller
+    float *append(const uint8_t *labels, size_t count);
+
+    size_t rows() const { return numRows; }
+    size_t cols() const { return numCols; }
+    bool spilled() const { return fd != -1; }
+
+    float *features() { return ptr; }
+    const float *features() const { return ptr; }
+    const uint8_t *labels() const { return labelData.data(); }
+};
+
+#endif
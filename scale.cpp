@@ -28,24 +28,30 @@ void Scale::init() {
     computeScaledSet();
 }
 
-void Scale::build() {
+void Scale::build(const std::vector<size_t> *subset) {
     #pragma omp critical
     {
-        std::cout << "Building scale " << id << " (" << scaledSet->count() << " points) ..." << std::endl;
+        std::cout << "Building scale " << id << " (" << scaledSet->count() << " points";
+        if (subset != nullptr) std::cout << ", features of " << subset->size() << " base points";
+        std::cout << ") ..." << std::endl;
     }
 
+    const long long int numPoints = subset != nullptr ? subset->size() : pSet->count();
+    buildGraph(knnGraph, KnnSearch, subset);
+    if (id == 1) buildGraph(radiusGraph, RadiusSearch, subset);
+
     #pragma omp parallel
     {
-        const KdTree *index = scaledSet->getIndex<KdTree>();
         Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
-        std::vector<size_t> neighborIds(kNeighbors);
-        std::vector<float> sqrDists(kNeighbors);
 
         #pragma omp for
-        for (long long int idx = 0; idx < pSet->count(); idx++) {
-            index->knnSearch(pSet->points[idx].data(), kNeighbors, neighborIds.data(), sqrDists.data());
-            Eigen::Vector3f medoid = computeMedoid(neighborIds);
-            Eigen::Matrix3d covariance = computeCovariance(neighborIds, medoid);
+        for (long long int k = 0; k < numPoints; k++) {
+            const size_t idx = subset != nullptr ? (*subset)[k] : k;
+            const uint32_t *neighborIds = knnGraph.neighbors(k);
+            const size_t numNeighbors = knnGraph.size(k);
+
+            Eigen::Vector3f medoid = computeMedoid(neighborIds, numNeighbors);
+            Eigen::Matrix3d covariance = computeCovariance(neighborIds, numNeighbors, medoid);
             solver.computeDirect(covariance);
             Eigen::Vector3d ev = solver.eigenvalues();
             for (size_t i = 0; i < 3; i++) ev[i] = std::max(ev[i], 0.0);
@@ -54,16 +60,6 @@ void Scale::build() {
             eigenValues[idx] = (ev / sum).cast<float>(); // sum-normalized
             eigenVectors[idx] = solver.eigenvectors().cast<float>();
 
-            // std::cout <<  "==Covariance==" << std::endl << 
-            //     covariance << std::endl;
-            // std::cout  << "==Medoid==" << std::endl << 
-            //     medoid << std::endl;
-            // std::cout <<  "==Eigenvalues==" << std::endl << 
-            //     eigenValues[idx] << std::endl;
-            // std::cout <<  "==Eigenvectors==" << std::endl << 
-            //     eigenVectors[idx] << std::endl;
-            // exit(1);
-
             // lambda1 = eigenValues[idx][2]
             // lambda3 = eigenValues[idx][0]
 
@@ -77,10 +73,9 @@ void Scale::build() {
             heightMin[idx] = std::numeric_limits<float>::max();
             heightMax[idx] = std::numeric_limits<float>::min();
 
-            for (size_t const &i : neighborIds) {
-                Eigen::Vector3f p(scaledSet->points[i][0],
-                    scaledSet->points[i][1],
-                    scaledSet->points[i][2]);
+            for (size_t i = 0; i < numNeighbors; i++) {
+                const auto &q = scaledSet->points[neighborIds[i]];
+                Eigen::Vector3f p(q[0], q[1], q[2]);
                 Eigen::Vector3f n = (p - medoid);
                 const float v00 = n.dot(eigenVectors[idx].col(2));
                 const float v01 = n.dot(eigenVectors[idx].col(1));
@@ -95,15 +90,15 @@ void Scale::build() {
         }
 
         if (id == 1) {
-            std::vector<nanoflann::ResultItem<size_t, float>> radiusMatches;
-
             #pragma omp for
-            for (long long int idx = 0; idx < pSet->count(); idx++) {
-                const size_t numMatches = index->radiusSearch(pSet->points[idx].data(), static_cast<float>(radius), radiusMatches);
+            for (long long int k = 0; k < numPoints; k++) {
+                const size_t idx = subset != nullptr ? (*subset)[k] : k;
+                const uint32_t *matches = radiusGraph.neighbors(k);
+                const size_t numMatches = radiusGraph.size(k);
                 avgHsv[idx] = { 0.f, 0.f, 0.f };
 
                 for (size_t i = 0; i < numMatches; i++) {
-                    const size_t nIdx = radiusMatches[i].first;
+                    const size_t nIdx = matches[i];
                     auto hsv = rgb2hsv(scaledSet->colors[nIdx][0],
                         scaledSet->colors[nIdx][1],
                         scaledSet->colors[nIdx][2]);
@@ -119,6 +114,26 @@ void Scale::build() {
         }
 
     }
+
+    // The kNN graph has no other use
+    knnGraph.release();
+    voxelGrid.reset();
+}
+
+void Scale::buildGraph(NeighborGraph &graph, const NeighborSearch search, const std::vector<size_t> *subset) {
+    const double param = search == KnnSearch ? kNeighbors : static_cast<float>(radius);
+    const bool cached = !cache.empty() && subset == nullptr;
+    const std::string filename = cache + ".s" + std::to_string(id) + (mortonOrder ? ".z" : "") + (search == KnnSearch ? ".knn" : ".radius");
+
+    const uint64_t targetHash = cached ? NeighborGraph::hashPoints(*scaledSet) : 0;
+
+    if (cached && graph.load(filename, search, param, resolution, scaledSet->count(), targetHash, pSet->count())) return;
+
+    if (search == KnnSearch && subset == nullptr && voxelGrid) graph.knn(*pSet, *scaledSet, kNeighbors, *voxelGrid);
+    else if (search == KnnSearch) graph.knn(*pSet, *scaledSet, kNeighbors, subset);
+    else graph.radius(*pSet, *scaledSet, static_cast<float>(radius), subset);
+
+    if (cached) graph.save(filename, resolution, targetHash);
 }
 
 void Scale::computeScaledSet() {
@@ -127,76 +142,72 @@ void Scale::computeScaledSet() {
 
         // Voxel centroid nearest neighbor
         // Roughly from https://raw.githubusercontent.com/PDAL/PDAL/master/filters/VoxelCentroidNearestNeighborFilter.cpp
-        const double x0 = pSet->points[0][0];
-        const double y0 = pSet->points[0][1];
-        const double z0 = pSet->points[0][2];
-
-        typedef std::make_signed_t<std::size_t> ssize_t;
 
         // Make an initial pass through the input to index indices by
         // row, column, and depth.
-        std::map<std::tuple<ssize_t, ssize_t, ssize_t>, std::vector<size_t> > populated_voxel_ids;
-
-        for (size_t id = 0; id < pSet->count(); id++) {
-            populated_voxel_ids[std::make_tuple(
-                static_cast<ssize_t>((pSet->points[id][0] - y0) / resolution),  // r
-                static_cast<ssize_t>((pSet->points[id][1] - x0) / resolution),  // c
-                static_cast<ssize_t>((pSet->points[id][2] - z0) / resolution) // d
-            )].push_back(id);
-        }
+        auto voxels = std::make_unique<VoxelGrid>(*pSet, resolution, mortonOrder, gridOrigin);
+        const VoxelGrid &grid = *voxels;
+        const double x0 = grid.x0;
+        const double y0 = grid.y0;
+        const double z0 = grid.z0;
 
         // Make a second pass through the populated voxels to compute the voxel
-        // centroid and to find its nearest neighbor.
-        scaledSet->points.clear();
-        scaledSet->colors.clear();
-
-        for (auto const &t : populated_voxel_ids) {
-            if (t.second.size() == 1) {
+        // centroid and to find its nearest neighbor. Every voxel yields exactly one
+        // point (at the voxel's position in the grid), so voxels can be processed
+        // in parallel and the result does not depend on the number of threads.
+        const size_t numVoxels = grid.count();
+        rowFirst = grid.lexicographicFirst;
+        const bool hasColors = pSet->hasColors();
+        scaledSet->points.resize(numVoxels);
+        scaledSet->colors.resize(hasColors ? numVoxels : 0);
+
+        #pragma omp parallel for schedule(dynamic, 4096)
+        for (long long int v = 0; v < numVoxels; v++) {
+            const size_t *ids = grid.points(v);
+            const size_t n = grid.size(v);
+            size_t pmin;
+
+            if (n == 1) {
                 // If there is only one point in the voxel, simply append it.
-                scaledSet->appendPoint(*pSet, t.second[0]);
-                if (trackPoints) scaledSet->trackPoint(*pSet, t.second[0]);
+                pmin = ids[0];
             }
-            else if (t.second.size() == 2) {
+            else if (n == 2) {
                 // Else if there are only two, they are equidistant to the
                 // centroid, so append the one closest to voxel center.
 
                 // Compute voxel center.
-                const double y_center = y0 + (std::get<0>(t.first) + 0.5) * resolution;
-                const double x_center = x0 + (std::get<1>(t.first) + 0.5) * resolution;
-                const double z_center = z0 + (std::get<2>(t.first) + 0.5) * resolution;
+                const auto cell = grid.cell(v);
+                const double y_center = y0 + (cell[0] + 0.5) * resolution;
+                const double x_center = x0 + (cell[1] + 0.5) * resolution;
+                const double z_center = z0 + (cell[2] + 0.5) * resolution;
 
                 // Compute distance from first point to voxel center.
-                const double x1 = pSet->points[t.second[0]][0];
-                const double y1 = pSet->points[t.second[0]][1];
-                const double z1 = pSet->points[t.second[0]][2];
+                const double x1 = pSet->points[ids[0]][0];
+                const double y1 = pSet->points[ids[0]][1];
+                const double z1 = pSet->points[ids[0]][2];
                 const double d1 = std::pow<double>(x_center - x1, 2) + std::pow<double>(y_center - y1, 2) + std::pow<double>(z_center - z1, 2);
                 // Compute distance from second point to voxel center.
-                const double x2 = pSet->points[t.second[1]][0];
-                const double y2 = pSet->points[t.second[1]][1];
-                const double z2 = pSet->points[t.second[1]][2];
+                const double x2 = pSet->points[ids[1]][0];
+                const double y2 = pSet->points[ids[1]][1];
+                const double z2 = pSet->points[ids[1]][2];
                 const double d2 = std::pow<double>(x_center - x2, 2) + std::pow<double>(y_center - y2, 2) + std::pow<double>(z_center - z2, 2);
 
                 // Append the closer of the two.
-                if (d1 < d2) scaledSet->appendPoint(*pSet, t.second[0]);
-                else scaledSet->appendPoint(*pSet, t.second[1]);
-
-                if (trackPoints) {
-                    scaledSet->trackPoint(*pSet, t.second[0]);
-                    scaledSet->trackPoint(*pSet, t.second[1]);
-                }
+                pmin = d1 < d2 ? ids[0] : ids[1];
             }
             else {
                 // Else there are more than two neighbors, so choose the one
                 // closest to the centroid.
 
                 // Compute the centroid.
-                Eigen::Vector3f centroid = computeCentroid(t.second);
+                Eigen::Vector3f centroid = computeCentroid(ids, n);
 
                 // Compute distance from each point in the voxel to the centroid,
                 // retaining only the closest.
-                size_t pmin = 0;
+                pmin = 0;
                 double dmin((std::numeric_limits<double>::max)());
-                for (auto const &p : t.second) {
+                for (size_t i = 0; i < n; i++) {
+                    const size_t p = ids[i];
                     const double sqr_dist = std::pow<double>(centroid[0] - pSet->points[p][0], 2) +
                         std::pow<double>(centroid[1] - pSet->points[p][1], 2) +
                         std::pow<double>(centroid[2] - pSet->points[p][2], 2);
@@ -205,16 +216,19 @@ void Scale::computeScaledSet() {
                         pmin = p;
                     }
                 }
+            }
 
-                scaledSet->appendPoint(*pSet, pmin);
+            scaledSet->points[v] = pSet->points[pmin];
+            if (hasColors) scaledSet->colors[v] = pSet->colors[pmin];
 
-                if (trackPoints) {
-                    for (auto const &p : t.second) {
-                        scaledSet->trackPoint(*pSet, p);
-                    }
+            if (trackPoints) {
+                for (size_t i = 0; i < n; i++) {
+                    pSet->pointMap[ids[i]] = v;
                 }
             }
         }
+
+        if (id > 0 && pSet->count() >= KNN_HIERARCHY_MIN_POINTS * numVoxels) voxelGrid = std::move(voxels);
     }
 
     if (id > 0) scaledSet->buildIndex<KdTree>();
@@ -224,55 +238,127 @@ void Scale::save(const std::string &filename) {
     savePointSet(*scaledSet, filename);
 }
 
-Eigen::Matrix3d Scale::computeCovariance(const std::vector<size_t> &neighborIds, const Eigen::Vector3f &medoid) {
-    Eigen::MatrixXd A(3, neighborIds.size());
-    size_t k = 0;
-
-    for (size_t const &i : neighborIds) {
-        A(0, k) = scaledSet->points[i][0] - medoid[0];
-        A(1, k) = scaledSet->points[i][1] - medoid[1];
-        A(2, k) = scaledSet->points[i][2] - medoid[2];
-        k++;
+// Streaming covariance of the neighbors around the medoid, with six
+// accumulators and no temporaries. K is the number of neighbors when known
+// at compile time (so that the loop can be fully unrolled), 0 otherwise.
+template <int K>
+static Eigen::Matrix3d covarianceKernel(const PointSet &pSet, const uint32_t *neighborIds, const size_t count, const Eigen::Vector3f &medoid) {
+    const size_t n = K > 0 ? K : count;
+    double xx = 0.0, xy = 0.0, xz = 0.0, yy = 0.0, yz = 0.0, zz = 0.0;
+
+    for (size_t k = 0; k < n; k++) {
+        const auto &p = pSet.points[neighborIds[k]];
+        const double dx = p[0] - medoid[0];
+        const double dy = p[1] - medoid[1];
+        const double dz = p[2] - medoid[2];
+
+        xx += dx * dx;
+        xy += dx * dy;
+        xz += dx * dz;
+        yy += dy * dy;
+        yz += dy * dz;
+        zz += dz * dz;
     }
 
-    return A * A.transpose() / (neighborIds.size() - 1);
+    Eigen::Matrix3d covariance;
+    covariance << xx, xy, xz,
+                  xy, yy, yz,
+                  xz, yz, zz;
+
+    return covariance / (n - 1);
 }
 
-Eigen::Vector3f Scale::computeMedoid(const std::vector<size_t> &neighborIds) {
-    float mx, my, mz;
-    mx = my = mz = 0.0;
-    float minDist = std::numeric_limits<float>::max();
-    for (size_t const &i : neighborIds) {
-        float sum = 0.0;
-        const float xi = scaledSet->points[i][0];
-        const float yi = scaledSet->points[i][1];
-        const float zi = scaledSet->points[i][2];
-
-        for (size_t const &j : neighborIds) {
-            sum += std::pow<double>(xi - scaledSet->points[j][0], 2) +
-                std::pow<double>(yi - scaledSet->points[j][1], 2) +
-                std::pow<double>(zi - scaledSet->points[j][2], 2);
+Eigen::Matrix3d Scale::computeCovariance(const uint32_t *neighborIds, const size_t count, const Eigen::Vector3f &medoid) {
+    if (count == K_NEIGHBORS) return covarianceKernel<K_NEIGHBORS>(*scaledSet, neighborIds, count, medoid);
+    return covarianceKernel<0>(*scaledSet, neighborIds, count, medoid);
+}
+
+// The sum of squared distances from p_i to all neighbors is
+// k * |p_i - c|^2 + sum_j |p_j - c|^2 (c being the centroid), so the medoid
+// is simply the neighbor closest to the centroid: one pass instead of k^2.
+// The O(k^2) loop this replaces rounded the sums to float, so neighbors that
+// tie up to that rounding (duplicates, points symmetric around the centroid)
+// are told apart by running that loop on them only, which picks the same one.
+Eigen::Vector3f Scale::computeMedoid(const uint32_t *neighborIds, const size_t count) {
+    const auto &points = scaledSet->points;
+
+    double cx = 0.0, cy = 0.0, cz = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        const auto &p = points[neighborIds[i]];
+        cx += p[0];
+        cy += p[1];
+        cz += p[2];
+    }
+    cx /= count;
+    cy /= count;
+    cz /= count;
+
+    auto centroidDist = [&](const size_t i) {
+        const auto &p = points[neighborIds[i]];
+        return (p[0] - cx) * (p[0] - cx) + (p[1] - cy) * (p[1] - cy) + (p[2] - cz) * (p[2] - cz);
+    };
+
+    size_t best = 0;
+    double minDist = std::numeric_limits<double>::max();
+    double sumDist = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        const double dist = centroidDist(i);
+        sumDist += dist;
+        if (dist < minDist) {
+            best = i;
+            minDist = dist;
         }
+    }
+
+    // Each float sum is off by less than (k + 2) / 2 float epsilons (relative):
+    // k roundings to float, plus the rounding of the differences that are
+    // squared. Two sums can only compare the other way round if they are
+    // within (k + 2) epsilons of each other, so candidates are the neighbors
+    // within four times that of the smallest sum.
+    const double tolerance = 4.0 * (count + 2) * std::numeric_limits<float>::epsilon();
+    const double bound = minDist + tolerance * (minDist + sumDist / count);
+
+    size_t candidates = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (centroidDist(i) <= bound) candidates++;
+    }
+
+    if (candidates > 1) {
+        float minSum = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < count; i++) {
+            if (centroidDist(i) > bound) continue;
+
+            float sum = 0.0;
+            const float xi = points[neighborIds[i]][0];
+            const float yi = points[neighborIds[i]][1];
+            const float zi = points[neighborIds[i]][2];
+
+            for (size_t j = 0; j < count; j++) {
+                sum += std::pow<double>(xi - points[neighborIds[j]][0], 2) +
+                    std::pow<double>(yi - points[neighborIds[j]][1], 2) +
+                    std::pow<double>(zi - points[neighborIds[j]][2], 2);
+            }
 
-        if (sum < minDist) {
-            mx = xi;
-            my = yi;
-            mz = zi;
-            minDist = sum;
+            if (sum < minSum) {
+                best = i;
+                minSum = sum;
+            }
         }
     }
 
+    const auto &m = points[neighborIds[best]];
     Eigen::Vector3f medoid;
-    medoid << mx, my, mz;
+    medoid << m[0], m[1], m[2];
 
     return medoid;
 }
 
-Eigen::Vector3f Scale::computeCentroid(const std::vector<size_t> &pointIds) {
+Eigen::Vector3f Scale::computeCentroid(const size_t *pointIds, const size_t count) {
     float mx, my, mz;
     mx = my = mz = 0.0;
     size_t n = 0;
-    for (auto const &j : pointIds) {
+    for (size_t i = 0; i < count; i++) {
+        const size_t j = pointIds[i];
         auto update = [&n](const float value, const float average) {
             const float delta = value - average;
             const float delta_n = delta / n;
@@ -290,16 +376,26 @@ Eigen::Vector3f Scale::computeCentroid(const std::vector<size_t> &pointIds) {
     return centroid;
 }
 
-std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius) {
+std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius, const std::string &cache, const bool mortonOrder) {
+    auto scales = initScales(numScales, pSet, startResolution, radius, cache, mortonOrder);
+    buildScales(scales);
+    return scales;
+}
+
+std::vector<Scale *> initScales(size_t numScales, PointSet *pSet, double startResolution, double radius, const std::string &cache, const bool mortonOrder) {
     std::vector<Scale *> scales(numScales, nullptr);
 
-    auto *base = new Scale(0, pSet, startResolution * std::pow<double>(2.0, 0), 10, radius);
+    auto *base = new Scale(0, pSet, startResolution * std::pow<double>(2.0, 0), K_NEIGHBORS, radius);
+    base->mortonOrder = mortonOrder;
     base->init();
     // base->save("base.ply");
     pSet->base = base->scaledSet;
 
     for (size_t i = 0; i < numScales; i++) {
-        scales[i] = new Scale(i + 1, base->scaledSet, startResolution * std::pow<double>(2.0, i), 10, radius);
+        scales[i] = new Scale(i + 1, base->scaledSet, startResolution * std::pow<double>(2.0, i), K_NEIGHBORS, radius);
+        scales[i]->cache = cache;
+        scales[i]->mortonOrder = mortonOrder;
+        if (mortonOrder && pSet->base->count() > 0) scales[i]->gridOrigin = &pSet->base->points[base->rowFirst];
     }
 
     // Save some time on the first scale
@@ -310,10 +406,12 @@ std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double star
         scales[i]->init();
     }
 
-    for (int i = 0; i < numScales; i++) {
-        scales[i]->build();
+    return scales;
+}
+
+void buildScales(const std::vector<Scale *> &scales, const std::vector<size_t> *subset) {
+    for (size_t i = 0; i < scales.size(); i++) {
+        scales[i]->build(subset);
         // scales[i]->save("scale_" + std::to_string(i + 1) + ".ply");
     }
-
-    return scales;
 }
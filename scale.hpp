@@ -1,10 +1,17 @@
 #ifndef SCALE_H
 #define SCALE_H
 
+#include <memory>
 #include <Eigen/Dense>
 #include "point_io.hpp"
 #include "color.hpp"
 #include "constants.hpp"
+#include "voxelgrid.hpp"
+#include "neighborgraph.hpp"
+
+// Scales whose voxels hold at least this many base points on average search
+// kNN coarse-to-fine (see NeighborGraph::knn)
+#define KNN_HIERARCHY_MIN_POINTS 8
 
 struct Scale {
     size_t id;
@@ -21,20 +28,52 @@ struct Scale {
     std::vector<float> heightMax;
     std::vector<std::array<float, 3> > avgHsv;
 
-    Eigen::Matrix3d computeCovariance(const std::vector<size_t> &neighborIds, const Eigen::Vector3f &medoid);
-    Eigen::Vector3f computeMedoid(const std::vector<size_t> &neighborIds);
-    Eigen::Vector3f computeCentroid(const std::vector<size_t> &pointIds);
+    // Neighbors of the base points in scaledSet (the radius graph is only
+    // built for the first scale, and kept for regularization)
+    NeighborGraph knnGraph;
+    NeighborGraph radiusGraph;
+
+    // Voxel grid that built scaledSet from pSet, kept until build() for
+    // coarse-to-fine kNN when its voxels are large enough
+    std::unique_ptr<VoxelGrid> voxelGrid;
+
+    // Order scaledSet's points along a Z-order curve of its voxels, instead
+    // of row by row, for memory locality in neighbor searches. Voxels are
+    // counted from gridOrigin if set (instead of pSet's first point), so
+    // that scales of a reordered base set keep the same voxels.
+    bool mortonOrder = false;
+    const std::array<float, 3> *gridOrigin = nullptr;
+    size_t rowFirst = 0; // point of scaledSet that is first in row by row order
+
+    // Path prefix where neighbor graphs are saved and loaded (optional)
+    std::string cache;
+
+    Eigen::Matrix3d computeCovariance(const uint32_t *neighborIds, size_t count, const Eigen::Vector3f &medoid);
+    Eigen::Vector3f computeMedoid(const uint32_t *neighborIds, size_t count);
+    Eigen::Vector3f computeCentroid(const size_t *pointIds, size_t count);
     void computeScaledSet();
     void save(const std::string &filename);
     void init();
-    void build();
+    void build(const std::vector<size_t> *subset = nullptr);
+    void buildGraph(NeighborGraph &graph, NeighborSearch search, const std::vector<size_t> *subset);
 
-    Scale(size_t id, PointSet *pSet, double resolution, int kNeighbors = 10, double radius = RADIUS);
+    Scale(size_t id, PointSet *pSet, double resolution, int kNeighbors = K_NEIGHBORS, double radius = RADIUS);
     ~Scale() {
         RELEASE_POINTSET(scaledSet);
     }
 };
 
-std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius);
+std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius, const std::string &cache = "", bool mortonOrder = false);
+
+// computeScales in two steps: initScales builds the base set (pSet->base,
+// pSet->pointMap) and the scaled sets, buildScales computes the features.
+// With a subset (ids of base points), only the features of those points are
+// computed; the others are left undefined (this is enough for training).
+// With a cache prefix, the neighbor graphs of full builds are saved to (and
+// loaded from) files starting with it. mortonOrder selects the point order of
+// the scaled sets (see Scale); either way pSet keeps its order and
+// pSet->pointMap maps it to the base set.
+std::vector<Scale *> initScales(size_t numScales, PointSet *pSet, double startResolution, double radius, const std::string &cache = "", bool mortonOrder = false);
+void buildScales(const std::vector<Scale *> &scales, const std::vector<size_t> *subset = nullptr);
 
 #endif
\ No newline at end of file
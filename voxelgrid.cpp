@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <omp.h>
+
+#include "voxelgrid.hpp"
+
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Shifts by 64 are undefined behavior, but can happen for degenerate grids
+static inline uint64_t shl(const uint64_t v, const int s) { return s >= 64 ? 0 : v << s; }
+static inline uint64_t shr(const uint64_t v, const int s) { return s >= 64 ? 0 : v >> s; }
+static inline uint64_t lowMask(const int b) { return b == 0 ? 0 : (~static_cast<uint64_t>(0) >> (64 - b)); }
+
+// Spread the low 21 bits of v to every third bit, and back
+static inline uint64_t spreadBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+static inline uint64_t compactBits(uint64_t v) {
+    v &= 0x1249249249249249ULL;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return v;
+}
+
+VoxelGrid::VoxelGrid(const PointSet &pSet, const double resolution, const bool morton, const std::array<float, 3> *origin) :
+    resolution(resolution), morton(morton) {
+    const size_t np = pSet.count();
+    if (np == 0) {
+        offsets.push_back(0);
+        return;
+    }
+
+    const auto &o = origin != nullptr ? *origin : pSet.points[0];
+    x0 = o[0];
+    y0 = o[1];
+    z0 = o[2];
+
+    // Same voxel assignment (including axis order) as the original
+    // map-based implementation, so that representatives don't change
+    const auto cellOf = [&](const size_t idx) {
+        return std::array<ssize_t, 3>{
+            static_cast<ssize_t>((pSet.points[idx][0] - y0) / resolution),  // r
+            static_cast<ssize_t>((pSet.points[idx][1] - x0) / resolution),  // c
+            static_cast<ssize_t>((pSet.points[idx][2] - z0) / resolution) // d
+        };
+    };
+
+    // First pass: find the extent of the grid to decide how many bits
+    // each axis needs in the key
+    ssize_t rMin, cMin, dMin, rMax, cMax, dMax;
+    const auto c0 = cellOf(0);
+    rMin = rMax = c0[0];
+    cMin = cMax = c0[1];
+    dMin = dMax = c0[2];
+
+    #pragma omp parallel for reduction(min: rMin, cMin, dMin) reduction(max: rMax, cMax, dMax)
+    for (long long int idx = 1; idx < np; idx++) {
+        const auto c = cellOf(idx);
+        rMin = std::min(rMin, c[0]);
+        cMin = std::min(cMin, c[1]);
+        dMin = std::min(dMin, c[2]);
+        rMax = std::max(rMax, c[0]);
+        cMax = std::max(cMax, c[1]);
+        dMax = std::max(dMax, c[2]);
+    }
+
+    minCell = { rMin, cMin, dMin };
+    const std::array<ssize_t, 3> maxCell = { rMax, cMax, dMax };
+
+    int totalBits = 0;
+    for (size_t j = 0; j < 3; j++) {
+        const uint64_t range = static_cast<uint64_t>(maxCell[j] - minCell[j]);
+        bits[j] = 0;
+        while (bits[j] < 64 && (range >> bits[j]) != 0) bits[j]++;
+        totalBits += bits[j];
+    }
+    const int mortonBits = std::max({ bits[0], bits[1], bits[2] });
+    if (mortonBits > 21) this->morton = false;
+    else if (this->morton) totalBits = 3 * mortonBits;
+
+    // Second pass: pack keys (r is the most significant, in each group of
+    // three bits with morton). Grids that need more than 64 bits (which are
+    // never Z-ordered) keep the cells unpacked instead, as (r, c, d) offsets
+    // from minCell, and are sorted by d, then c, then r.
+    const bool wide = totalBits > 64;
+    std::vector<uint64_t> pointKeys(wide ? 0 : np);
+    std::vector<std::array<uint64_t, 3> > pointCells(wide ? np : 0);
+    ids.resize(np);
+
+    #pragma omp parallel for
+    for (long long int idx = 0; idx < np; idx++) {
+        const auto c = cellOf(idx);
+        const uint64_t r = static_cast<uint64_t>(c[0] - minCell[0]);
+        const uint64_t cc = static_cast<uint64_t>(c[1] - minCell[1]);
+        const uint64_t d = static_cast<uint64_t>(c[2] - minCell[2]);
+        if (wide) pointCells[idx] = { r, cc, d };
+        else pointKeys[idx] = this->morton ?
+            spreadBits(r) << 2 | spreadBits(cc) << 1 | spreadBits(d) :
+            shl(r, bits[1] + bits[2]) | shl(cc, bits[2]) | d;
+        ids[idx] = idx;
+    }
+
+    // Radix passes, least significant first: (field, shift) pairs, where
+    // field 3 is the packed key
+    std::vector<std::pair<int, int> > passes;
+    if (wide) {
+        for (int j = 2; j >= 0; j--) {
+            for (int shift = 0; shift < bits[j]; shift += RADIX_BITS) passes.emplace_back(j, shift);
+        }
+    }
+    else {
+        for (int shift = 0; shift < totalBits; shift += RADIX_BITS) passes.emplace_back(3, shift);
+    }
+
+    // LSD radix sort over the used bits only. Every thread owns a contiguous
+    // chunk of the input and buckets are laid out bucket-major, thread-minor,
+    // so each pass is stable and point indices stay in ascending order within
+    // a voxel regardless of the number of threads.
+    std::vector<uint64_t> keysTmp(pointKeys.size());
+    std::vector<std::array<uint64_t, 3> > cellsTmp(pointCells.size());
+    std::vector<size_t> idsTmp(np);
+    const int maxThreads = omp_get_max_threads();
+    std::vector<size_t> hist(static_cast<size_t>(maxThreads) * RADIX_BUCKETS);
+    std::vector<size_t> starts(maxThreads + 1);
+
+    #pragma omp parallel num_threads(maxThreads)
+    {
+        const size_t t = omp_get_thread_num();
+        const size_t nt = omp_get_num_threads();
+        const size_t begin = np * t / nt;
+        const size_t end = np * (t + 1) / nt;
+        size_t *h = &hist[t * RADIX_BUCKETS];
+        const auto digit = [&](const size_t i, const std::pair<int, int> &pass) {
+            const uint64_t k = pass.first == 3 ? pointKeys[i] : pointCells[i][pass.first];
+            return (k >> pass.second) & (RADIX_BUCKETS - 1);
+        };
+        const auto sameVoxel = [&](const size_t i, const size_t j) {
+            return wide ? pointCells[i] == pointCells[j] : pointKeys[i] == pointKeys[j];
+        };
+
+        for (const auto &pass : passes) {
+            std::fill(h, h + RADIX_BUCKETS, 0);
+            for (size_t i = begin; i < end; i++) h[digit(i, pass)]++;
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                size_t sum = 0;
+                for (size_t b = 0; b < RADIX_BUCKETS; b++) {
+                    for (size_t tt = 0; tt < nt; tt++) {
+                        const size_t c = hist[tt * RADIX_BUCKETS + b];
+                        hist[tt * RADIX_BUCKETS + b] = sum;
+                        sum += c;
+                    }
+                }
+            }
+
+            for (size_t i = begin; i < end; i++) {
+                const size_t dst = h[digit(i, pass)]++;
+                if (wide) cellsTmp[dst] = pointCells[i];
+                else keysTmp[dst] = pointKeys[i];
+                idsTmp[dst] = ids[i];
+            }
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                pointKeys.swap(keysTmp);
+                pointCells.swap(cellsTmp);
+                ids.swap(idsTmp);
+            }
+        }
+
+        // Group runs of equal keys into voxels: count the voxels starting in
+        // each chunk, then let every thread write its own range of voxels
+        size_t localCount = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (i == 0 || !sameVoxel(i, i - 1)) localCount++;
+        }
+        starts[t + 1] = localCount;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            starts[0] = 0;
+            for (size_t tt = 0; tt < nt; tt++) starts[tt + 1] += starts[tt];
+            keys.resize(wide ? 0 : starts[nt]);
+            cells.resize(wide ? starts[nt] : 0);
+            offsets.resize(starts[nt] + 1);
+            offsets[starts[nt]] = np;
+        }
+
+        size_t v = starts[t];
+        for (size_t i = begin; i < end; i++) {
+            if (i == 0 || !sameVoxel(i, i - 1)) {
+                if (wide) cells[v] = pointCells[i];
+                else keys[v] = pointKeys[i];
+                offsets[v] = i;
+                v++;
+            }
+        }
+    }
+
+    if (this->morton) {
+        for (size_t v = 1; v < count(); v++) {
+            if (cell(v) < cell(lexicographicFirst)) lexicographicFirst = v;
+        }
+    }
+}
+
+std::array<VoxelGrid::ssize_t, 3> VoxelGrid::cell(const size_t v) const {
+    if (!cells.empty()) {
+        return {
+            minCell[0] + static_cast<ssize_t>(cells[v][0]),
+            minCell[1] + static_cast<ssize_t>(cells[v][1]),
+            minCell[2] + static_cast<ssize_t>(cells[v][2])
+        };
+    }
+
+    const uint64_t k = keys[v];
+
+    if (morton) {
+        return {
+            minCell[0] + static_cast<ssize_t>(compactBits(k >> 2)),
+            minCell[1] + static_cast<ssize_t>(compactBits(k >> 1)),
+            minCell[2] + static_cast<ssize_t>(compactBits(k))
+        };
+    }
+
+    return {
+        minCell[0] + static_cast<ssize_t>(shr(k, bits[1] + bits[2]) & lowMask(bits[0])),
+        minCell[1] + static_cast<ssize_t>(shr(k, bits[2]) & lowMask(bits[1])),
+        minCell[2] + static_cast<ssize_t>(k & lowMask(bits[2]))
+    };
+}
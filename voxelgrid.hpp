@@ -0,0 +1,48 @@
+#ifndef VOXELGRID_H
+#define VOXELGRID_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "point_io.hpp"
+
+// Flat voxel index of a point set. Voxel coordinates are packed into a
+// 64-bit key whose ordering matches the lexicographic (r, c, d) ordering,
+// points are radix sorted by key and grouped in a single index array
+// (CSR layout: voxel v owns ids[offsets[v]] ... ids[offsets[v + 1] - 1]).
+// With morton, keys interleave the bits of r, c and d instead, so that
+// voxels are in Z-order (nearby voxels mostly have nearby indices); grids
+// too large for 21 bits per axis keep the lexicographic order. Cells are
+// counted from origin (by default, the first point). Grids whose extent
+// needs more than 64 bits are sorted by the unpacked cells instead, in the
+// same lexicographic order.
+struct VoxelGrid {
+    typedef std::make_signed_t<std::size_t> ssize_t;
+
+    double resolution;
+    double x0, y0, z0;
+
+    std::vector<uint64_t> keys; // One per occupied voxel, ascending (empty for wide grids)
+    std::vector<std::array<uint64_t, 3> > cells; // Cells of wide grids, as offsets from minCell
+    std::vector<size_t> offsets;
+    std::vector<size_t> ids; // Point indices, ascending within each voxel
+
+    // Voxel that is first in lexicographic order (0 unless morton)
+    size_t lexicographicFirst = 0;
+
+    VoxelGrid(const PointSet &pSet, double resolution, bool morton = false, const std::array<float, 3> *origin = nullptr);
+
+    inline size_t count() const { return offsets.size() - 1; }
+    inline size_t size(size_t v) const { return offsets[v + 1] - offsets[v]; }
+    inline const size_t *points(size_t v) const { return ids.data() + offsets[v]; }
+
+    // Row, column and depth of voxel v
+    std::array<ssize_t, 3> cell(size_t v) const;
+private:
+    std::array<ssize_t, 3> minCell;
+    std::array<int, 3> bits;
+    bool morton;
+};
+
+#endif